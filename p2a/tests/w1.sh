@@ -0,0 +1,2 @@
+echo sourced $(echo once)
+ls tests/w1.sh
@@ -0,0 +1 @@
+cd tests
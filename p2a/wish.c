@@ -1,76 +1,310 @@
+#define _GNU_SOURCE  // pipe2(), sched_setaffinity()
 #include <stdio.h>  // IO operations
 #include <stdlib.h>  // memory allocations
 #include <string.h>  // string operations
 #include <unistd.h>  // symbolic constants
 #include <ctype.h>  // character operations
-#include <sys/wait.h>  // for wait() system call
+#include <limits.h>  // PATH_MAX
+#include <time.h>  // clock_gettime() for wall clock time
+#include <sys/time.h>  // timeval arithmetic
+#include <sys/resource.h>  // getrusage() and struct rusage
+#include <sys/wait.h>  // for wait() and wait4() system calls
 #include <fcntl.h>  // for access() system call
+#include <signal.h>  // signal masks
+#include <sys/signalfd.h>  // signalfd() to reap background jobs
+#include <poll.h>  // wait for input and SIGCHLD together
+#include <errno.h>  // errno for in-process command error messages
+#include <sys/stat.h>  // fstat() for in-process cat
+#include <sched.h>  // sched_setaffinity() for pin
+#include <sys/socket.h>  // socketpair() for the fork server
 
-#define LINE_BUFSIZE 1024  // max number of bytes in an input line on my shell
-#define ARG_BUFSIZE 32  // max number of space separated tokens in an input line on my shell
+#define LINE_BUFSIZE 1024  // initial number of bytes reserved for an input line, grown by getline() on demand
+#define ARG_BUFSIZE 32  // initial number of token slots in the token arena, doubled on demand
 char *gp_errorMessage = "An error has occurred\n";
 int g_errorReturn;  // file descriptor codes
 
+// per-line token arena
+// token pointers point into the line buffer, so parsing a line allocates nothing once the arena has grown
+// to the widest line seen; the arena is reset, never freed, between lines
+typedef struct __TokenArena {
+    char **dp_tokens;  // NULL terminated token array
+    int numTokens;  // number of tokens in use
+    int capacity;  // number of token slots reserved (excluding the NULL terminator)
+} TokenArena;
+
+// strings created while expanding a line (command substitution) are carved from blocks that are kept
+// and reused once the arena is reset
+#define STRING_BLOCKSIZE 4096  // minimum size of a string arena block
+typedef struct __StringBlock {
+    struct __StringBlock *p_next;
+    size_t used;  // bytes handed out
+    size_t size;  // bytes in data
+    char data[];
+} StringBlock;
+
+typedef struct __StringArena {
+    StringBlock *p_head;  // first block, blocks are never freed
+    StringBlock *p_curr;  // block strings are currently carved from
+} StringArena;
+
+TokenArena g_lineTokens;  // tokens of the current input line
+TokenArena g_loopTokens;  // per-iteration arguments of the loop built-in command
+TokenArena g_expandTokens;  // arguments of the current line after command substitution
+TokenArena g_loopExpandTokens;  // per-iteration arguments of loop after command substitution
+StringArena g_lineStrings;  // words produced by command substitution on the current line
+StringArena g_loopStrings;  // words produced by command substitution in the current loop iteration
+TokenArena g_pathDir;  // directories searched for executables, each one owned (strdup'd) by the arena
+unsigned long g_resolveGen = 1;  // bumped by cd, path and inproc, which change what a command name resolves to
+
+// per-command timing (time built-in, -T and -S flags)
+typedef struct __TimeEntry {
+    char *p_cmd;  // command name (first argument)
+    long runs;  // number of times the command was executed
+    double real, maxReal, user, sys;  // seconds
+    long maxRss;  // kilobytes
+    long nvcsw, nivcsw;  // voluntary and involuntary context switches
+} TimeEntry;
+
+int g_timeAll = 0;  // -T: report resource usage of every command
+int g_timeSummary = 0;  // -S: print a per-command summary table when the batch file ends
+int g_timing = 0;  // set while a command is being timed, nested time built-ins do not report twice
+struct rusage g_childUsage;  // usage of every child reaped while the current command is timed
+TimeEntry *gp_timeTable = NULL;  // summary table, one entry per distinct command name
+int g_timeEntries = 0, g_timeCapacity = 0;
+
+// background jobs (trailing &, jobs and wait built-ins)
+#define JOB_RUNNING 0
+#define JOB_DONE 1
+typedef struct __Job {
+    int id;  // job number shown by jobs and accepted by wait
+    pid_t pid;  // process running the job
+    int state;  // JOB_RUNNING or JOB_DONE
+    int status;  // exit status once done
+    char *p_cmd;  // command line, without the trailing &
+} Job;
+
+Job *gp_jobs = NULL;  // job table, ordered by job number
+int g_numJobs = 0, g_jobCapacity = 0;
+int g_interactive = 0;  // interactive mode, finished jobs are reported at the next prompt
+int g_sigFd = -1;  // signalfd receiving SIGCHLD, readable whenever a child has terminated
+sigset_t g_origSigMask;  // signal mask restored in children before they run a command
+
+// in-process commands
+// trivial commands that would otherwise cost a fork() and execv() run inside the shell when PATH resolves them
+// to the system binary (/bin or /usr/bin); a handler returns the exit status, or -1 when it sees an argument
+// it does not implement, in which case the real executable runs instead
+#define NUM_BUILTIN_CMDS 11  // built-in commands numbered 1..NUM_BUILTIN_CMDS, in-process commands follow
+#define IO_BUFSIZE 65536  // bytes copied per read()/write() by in-process cat
+typedef struct __InProcCmd {
+    char *p_name;  // command name
+    int (*p_run)(char **dp_args, int numArgs, int outFd, int errFd);  // handler
+    int enabled;  // configured with the inproc built-in
+} InProcCmd;
+
+int RunEcho(char **dp_args, int numArgs, int outFd, int errFd);
+int RunTrue(char **dp_args, int numArgs, int outFd, int errFd);
+int RunPwd(char **dp_args, int numArgs, int outFd, int errFd);
+int RunCat(char **dp_args, int numArgs, int outFd, int errFd);
+
+InProcCmd g_inProcCmds[] = {
+    {"echo", RunEcho, 1},
+    {"true", RunTrue, 1},
+    {"pwd", RunPwd, 1},
+    {"cat", RunCat, 1},
+};
+int g_numInProcCmds = sizeof(g_inProcCmds) / sizeof(g_inProcCmds[0]);
+
+// launch options of the pin and nice built-ins, applied by every child started for the command they prefix
+typedef struct __LaunchOpts {
+    int numCpus;  // CPUs given to pin, 0 if not pinned
+    int *p_cpus;  // CPU numbers, in the order given
+    int cpu;  // CPU the next child is pinned to alone (loop iterations go round-robin), -1 for all of p_cpus
+    int niced;  // a nice increment was given
+    int niceIncrement;  // sum of the increments of nested nice built-ins
+} LaunchOpts;
+
+LaunchOpts g_launch = {0, NULL, -1, 0, 0};
+
+// command launch tracing (-x or WISH_TRACE=<file>)
+// one JSON line per launched command with CLOCK_MONOTONIC timestamps (ns) of every phase, 0 if it did not happen;
+// wishtrace summarizes them
+#define TRACE_BUFSIZE (PATH_MAX + 512)  // bytes of one trace record
+typedef struct __TraceStamps {
+    long long parseStart, parseEnd;  // line read, tokens ready (first command of a line only)
+    long long resolveStart, resolveEnd;  // PATH lookup (CheckCommand)
+    long long forkStart, forkEnd;  // fork() as seen by the shell
+    long long execEnd;  // child has exec'd (its close-on-exec pipe was closed)
+    long long exit;  // child reaped, or in-process command returned
+} TraceStamps;
+
+int g_traceFd = -1;  // trace records are appended here, -1 if tracing is off
+TraceStamps g_trace;  // timestamps of the command being launched
+
+// fork server (-z)
+// a helper forked at startup, while the shell is still small, runs foreground commands on request over a
+// socketpair, so the cost of fork() does not grow with the shell's heap; it replies with the pid once the
+// child is started and with its status and resource usage once it has been reaped
+typedef struct __ZygoteRequest {
+    int numArgs;
+    int redirectionPos;
+    int numCpus, cpu, niced, niceIncrement;  // launch options (pin, nice)
+    int trace;  // report when the child has exec'd
+    size_t length;  // bytes of payload following: CPU numbers, then NUL terminated cwd, path and arguments
+} ZygoteRequest;
+
+typedef struct __ZygoteReply {
+    pid_t pid;
+    int exited;  // 0 once started, 1 once reaped
+    int status;  // wait status
+    struct rusage usage;
+    long long forkEnd, execEnd;  // CLOCK_MONOTONIC timestamps (ns) of the launch if tracing, else 0
+} ZygoteReply;
+
+int g_zygoteFd = -1;  // shell end of the socketpair, -1 if commands are forked by the shell
+
 void PrintError()
 {
     g_errorReturn = write(STDERR_FILENO, gp_errorMessage, strlen(gp_errorMessage));
 }
 
-char *ReadLine()
+void ResetTokens(TokenArena *p_arena)
+{
+    p_arena->numTokens = 0;
+    if(p_arena->dp_tokens != NULL)
+        p_arena->dp_tokens[0] = NULL;
+}
+
+void PushToken(TokenArena *p_arena, char *token)
 {
-    char *p_line;  // string input
-    size_t BUFSIZE = LINE_BUFSIZE;
-    p_line = (char *) malloc(LINE_BUFSIZE * sizeof(char));  // allocating space for the input string
-    if(getline(&p_line, &BUFSIZE, stdin) == -1)  // error in reading line
+    if(p_arena->numTokens == p_arena->capacity)  // out of slots, double the arena
     {
-        //print error message
-        PrintError();
-        return NULL;
+        int capacity = (p_arena->capacity == 0) ? ARG_BUFSIZE : 2 * p_arena->capacity;
+        char **dp_tokens = realloc(p_arena->dp_tokens, (capacity + 1) * sizeof(char*));
+        if(dp_tokens == NULL)
+        {
+            PrintError();
+            exit(1);
+        }
+        p_arena->dp_tokens = dp_tokens;
+        p_arena->capacity = capacity;
     }
-    return p_line;
+    p_arena->dp_tokens[p_arena->numTokens++] = token;
+    p_arena->dp_tokens[p_arena->numTokens] = NULL;
 }
 
-char **SplitLine(char *line)
+void ResetStrings(StringArena *p_arena)
 {
-    int numTokens = 0;  // number of arguments or tokens
-    char **tokens = malloc(ARG_BUFSIZE * sizeof(char*));  //allocating space for the arguments
-    char *token;  //each argument token
+    for(StringBlock *p_block = p_arena->p_head; p_block != NULL; p_block = p_block->p_next)
+        p_block->used = 0;
+    p_arena->p_curr = p_arena->p_head;
+}
 
-    if(strstr(line, ">") != NULL)
+// copy length bytes into the arena as a NUL terminated string
+char *CopyString(StringArena *p_arena, char *p_src, size_t length)
+{
+    StringBlock *p_block = p_arena->p_curr;
+    // move on to the next kept block, or insert a new one, if the string does not fit
+    while(p_block == NULL || p_block->used + length + 1 > p_block->size)
     {
-        char *leftRedirection = strsep(&line, ">");
-        char *rightRedirection = strsep(&line, ">");
+        if(p_block != NULL && p_block->p_next != NULL && p_block->p_next->size >= length + 1)
+        {
+            p_block = p_block->p_next;
+            p_block->used = 0;
+            continue;
+        }
+        size_t size = (length + 1 > STRING_BLOCKSIZE) ? length + 1 : STRING_BLOCKSIZE;
+        StringBlock *p_new = malloc(sizeof(StringBlock) + size);
+        if(p_new == NULL)
+        {
+            PrintError();
+            exit(1);
+        }
+        p_new->used = 0;
+        p_new->size = size;
+        if(p_block == NULL)
+        {
+            p_new->p_next = p_arena->p_head;
+            p_arena->p_head = p_new;
+        }
+        else
+        {
+            p_new->p_next = p_block->p_next;
+            p_block->p_next = p_new;
+        }
+        p_block = p_new;
+    }
+    p_arena->p_curr = p_block;
+    char *p_str = p_block->data + p_block->used;
+    memcpy(p_str, p_src, length);
+    p_str[length] = '\0';
+    p_block->used += length + 1;
+    return p_str;
+}
 
-        //extracting arguments
-        while((token = strsep(&leftRedirection, " \t")) != NULL)
-            tokens[numTokens++] = token;
-        tokens[numTokens - 1][strcspn(tokens[numTokens - 1], "\n")] = 0;
-        tokens[numTokens++] = ">";
-        while((token = strsep(&rightRedirection, " \t")) != NULL)
-            tokens[numTokens++] = token;
-        tokens[numTokens - 1][strcspn(tokens[numTokens - 1], "\n")] = 0;
-        tokens[numTokens] = NULL;
+ssize_t ReadLine(FILE *fp, char **dp_line, size_t *p_bufSize)
+{
+    if(*dp_line == NULL)  // first call, reserve the reusable line buffer
+    {
+        *p_bufSize = LINE_BUFSIZE;
+        *dp_line = (char *) malloc(LINE_BUFSIZE * sizeof(char));
     }
-    else
+    // getline() grows the buffer in place if a line does not fit, the buffer is reused for every later line
+    return getline(dp_line, p_bufSize, fp);
+}
+
+char **SplitLine(char *line, TokenArena *p_arena)
+{
+    ResetTokens(p_arena);
+    while(*line != '\0')
     {
-        //extracting arguments
-        while((token = strsep(&line, " \t")) != NULL)
-            tokens[numTokens++] = token;
-        tokens[numTokens - 1][strcspn(tokens[numTokens - 1], "\n")] = 0;
-        tokens[numTokens] = NULL;
+        // skip separators
+        while(isspace((unsigned char) *line))
+            line++;
+        if(*line == '\0')
+            break;
+        // redirection and background are tokens of their own, even when written without spaces around them
+        if(*line == '>' || *line == '&')
+        {
+            PushToken(p_arena, (*line == '>') ? ">" : "&");
+            *line++ = '\0';  // also terminates a word written right before the operator
+            continue;
+        }
+        //extracting arguments, a command substitution $(...) belongs to the word it appears in
+        PushToken(p_arena, line);
+        int depth = 0;
+        while(*line != '\0' && (depth > 0 || (!isspace((unsigned char) *line) && *line != '>' && *line != '&')))
+        {
+            if(line[0] == '$' && line[1] == '(')
+            {
+                depth++;
+                line++;
+            }
+            else if(line[0] == ')' && depth > 0)
+                depth--;
+            line++;
+        }
+        if(*line != '\0' && *line != '>' && *line != '&')
+            *line++ = '\0';
     }
-    return tokens;
+    return p_arena->dp_tokens;
 }
 
 int IsBuiltInCommand(char *cmd)
 {
-    int numBuiltInCmds = 4, builtInCmdNo = 0;
+    int numBuiltInCmds = NUM_BUILTIN_CMDS, builtInCmdNo = 0;
     char *listBuiltInCmds[numBuiltInCmds];
 
     listBuiltInCmds[0] = "exit";
     listBuiltInCmds[1] = "cd";
     listBuiltInCmds[2] = "path";
     listBuiltInCmds[3] = "loop";
+    listBuiltInCmds[4] = "time";
+    listBuiltInCmds[5] = "jobs";
+    listBuiltInCmds[6] = "wait";
+    listBuiltInCmds[7] = "inproc";
+    listBuiltInCmds[8] = "pin";
+    listBuiltInCmds[9] = "nice";
+    listBuiltInCmds[10] = "source";
 
     for(int i = 0; i < numBuiltInCmds; i++)
     {
@@ -80,300 +314,2344 @@ int IsBuiltInCommand(char *cmd)
             break;
         }
     }
+    // enabled in-process commands
+    for(int i = 0; builtInCmdNo == 0 && i < g_numInProcCmds; i++)
+    {
+        if(g_inProcCmds[i].enabled && strcmp(cmd, g_inProcCmds[i].p_name) == 0)
+            builtInCmdNo = NUM_BUILTIN_CMDS + 1 + i;
+    }
     return builtInCmdNo;
 }
 
+long long TraceNow()
+{
+    struct timespec now;
+    if(g_traceFd < 0)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// append the trace record of a launched command and start over for the next one
+void TraceCommand(char *p_cmd, char *p_kind, pid_t pid, int status)
+{
+    char p_record[TRACE_BUFSIZE], p_name[PATH_MAX];
+    size_t length = 0;
+    if(g_traceFd < 0)
+        return;
+    // escape the command name as a JSON string
+    for(; *p_cmd != '\0' && length + 7 < sizeof(p_name); p_cmd++)
+    {
+        if(*p_cmd == '"' || *p_cmd == '\\')
+        {
+            p_name[length++] = '\\';
+            p_name[length++] = *p_cmd;
+        }
+        else if((unsigned char) *p_cmd < 0x20)
+            length += sprintf(p_name + length, "\\u%04x", (unsigned char) *p_cmd);
+        else
+            p_name[length++] = *p_cmd;
+    }
+    p_name[length] = '\0';
+    int bytes = snprintf(p_record, sizeof(p_record),
+                         "{\"cmd\":\"%s\",\"kind\":\"%s\",\"pid\":%d,\"status\":%d,\"parse_start\":%lld,"
+                         "\"parse_end\":%lld,\"resolve_start\":%lld,\"resolve_end\":%lld,\"fork_start\":%lld,"
+                         "\"fork_end\":%lld,\"exec_end\":%lld,\"exit\":%lld}\n",
+                         p_name, p_kind, (int) pid, status, g_trace.parseStart, g_trace.parseEnd, g_trace.resolveStart,
+                         g_trace.resolveEnd, g_trace.forkStart, g_trace.forkEnd, g_trace.execEnd, g_trace.exit);
+    // one write per record, so records of concurrent shells and children do not interleave
+    g_errorReturn = write(g_traceFd, p_record, bytes);
+    memset(&g_trace, 0, sizeof(g_trace));
+}
+
 int CheckCommand(char *p_path, char **dp_pathDir, char **dp_args)
 {
+    g_trace.resolveStart = TraceNow();
     for(int i = 0; dp_pathDir[i] != NULL; i++)
     {
         // making the first argument as the absolute path to the exec file i.e. <path>/<filename>
-        strcpy(p_path, dp_pathDir[i]);
-        strcat(p_path, "/");
-        strcat(p_path, dp_args[0]);
+        if(snprintf(p_path, PATH_MAX, "%s/%s", dp_pathDir[i], dp_args[0]) >= PATH_MAX)
+            continue;
         // check if the exec file with absolute path exists
         if(access(p_path, X_OK) == 0)
+        {
+            g_trace.resolveEnd = TraceNow();
             return 0;
+        }
     }
+    // traced as a command that failed without being launched
+    g_trace.resolveEnd = g_trace.exit = TraceNow();
+    TraceCommand(dp_args[0], "unresolved", 0, 1);
     return 1;
 }
 
-int ExecuteBuiltInCommand(char *p_cmd, char **dp_args, char **dp_pathDir, int cmdNo)
+// charge the resource usage of a reaped child to the command being timed
+void AddChildUsage(struct rusage *p_usage)
 {
-    int countArgs;
-    int countArgsModified;
-    int loopCount;
-    char **dp_argsModified = malloc(ARG_BUFSIZE * sizeof(char*));
+    timeradd(&g_childUsage.ru_utime, &p_usage->ru_utime, &g_childUsage.ru_utime);
+    timeradd(&g_childUsage.ru_stime, &p_usage->ru_stime, &g_childUsage.ru_stime);
+    g_childUsage.ru_maxrss = (p_usage->ru_maxrss > g_childUsage.ru_maxrss) ? p_usage->ru_maxrss : g_childUsage.ru_maxrss;
+    g_childUsage.ru_nvcsw += p_usage->ru_nvcsw;
+    g_childUsage.ru_nivcsw += p_usage->ru_nivcsw;
+}
 
-    switch(cmdNo)
-    {
-        // exit
-        case 1:
-            if(dp_args[1] != NULL)  // incorrect number of arguments
-            {
-                // print error message
-                PrintError();
-                return 1;
-            }
-            exit(0);
-        // cd
-        case 2:
-            // early exit condition
-            if(dp_args[1] == NULL)  // incorrect number of arguments (0)
-            {
-                PrintError();
-                return 1;
-            }
-            else if(dp_args[2] != NULL)  // incorrect number of arguments (>1)
-            {
-                PrintError();
-                return 1;    
-            }
-            else  
-            {
-                // if chdir did not succeed
-                if(chdir(dp_args[1]) != 0)
-                {
-                    PrintError();
-                    return 1;
-                }
-                else
-                    return 0;
-            }
-        // path
-        case 3:
-            // overwriting path directory with passed arguments
-            for(countArgs = 1; dp_args[countArgs] != NULL; countArgs++)
-                dp_pathDir[countArgs - 1] = dp_args[countArgs];
-            dp_pathDir[countArgs - 1] = NULL;
-            return 0;
+// reap the given child and charge its resource usage to the command being timed
+pid_t WaitChild(pid_t pid, int *p_status)
+{
+    struct rusage usage;
+    pid_t rc = wait4(pid, p_status, 0, &usage);
+    if(rc > 0)
+        AddChildUsage(&usage);
+    return rc;
+}
 
-        // loop
-        case 4:
-            if(dp_args[1] == NULL)
+double Seconds(struct timeval tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+void AddTimeEntry(char *p_cmd, double real, double user, double sys, long maxRss, long nvcsw, long nivcsw)
+{
+    TimeEntry *p_entry = NULL;
+    for(int i = 0; i < g_timeEntries; i++)
+    {
+        if(strcmp(gp_timeTable[i].p_cmd, p_cmd) == 0)
+        {
+            p_entry = &gp_timeTable[i];
+            break;
+        }
+    }
+    if(p_entry == NULL)  // first run of this command
+    {
+        if(g_timeEntries == g_timeCapacity)
+        {
+            g_timeCapacity = (g_timeCapacity == 0) ? ARG_BUFSIZE : 2 * g_timeCapacity;
+            gp_timeTable = realloc(gp_timeTable, g_timeCapacity * sizeof(TimeEntry));
+            if(gp_timeTable == NULL)
             {
                 PrintError();
-                return 1;
-            }
-            else
-            {
-                loopCount = atoi(dp_args[1]);
-                if(loopCount <= 0)
-                {
-                    PrintError();
-                    return 1;
-                }
-            }
-            countArgsModified = 0;
-            for(int i = 2; dp_args[i] != NULL; i++)
-            {
-                dp_argsModified[i - 2] = strdup(dp_args[i]);
-                countArgsModified++;
-            }
-            dp_argsModified[countArgsModified] = NULL;
-            char p_loopCmdPath[128];
-            for(int i = 0; i < loopCount; i++)
-            {
-                size_t pid = fork();
-                if(pid < 0)
-                {
-                    PrintError();
-                    exit(1);
-                }
-                else if(pid == 0)
-                {
-                    // replace $loop occurences with counter
-                    for(int j = 0; j < countArgsModified; j++)
-                    {
-                        if(strcmp(dp_argsModified[j], "$loop") == 0)
-                        {
-                            int length = snprintf(NULL, 0, "%d", i + 1);
-                            char* str = malloc(length + 1);
-                            snprintf(str, length + 1, "%d", i + 1);
-                            dp_argsModified[j] = strdup(str);
-                        }
-                    }
-                    if(CheckCommand(p_loopCmdPath, dp_pathDir, dp_argsModified) == 0)
-                        execv(p_loopCmdPath, dp_argsModified);
-                    PrintError();
-                    exit(1);
-                }
-                else
-                    wait(NULL);
+                exit(1);
             }
+        }
+        p_entry = &gp_timeTable[g_timeEntries++];
+        memset(p_entry, 0, sizeof(TimeEntry));
+        p_entry->p_cmd = strdup(p_cmd);
     }
-    return 0;
+    p_entry->runs++;
+    p_entry->real += real;
+    p_entry->maxReal = (real > p_entry->maxReal) ? real : p_entry->maxReal;
+    p_entry->user += user;
+    p_entry->sys += sys;
+    p_entry->maxRss = (maxRss > p_entry->maxRss) ? maxRss : p_entry->maxRss;
+    p_entry->nvcsw += nvcsw;
+    p_entry->nivcsw += nivcsw;
 }
 
-char *TrimWhiteSpace(char *str)
+// print the summary table to STDERR, slowest commands (by total wall time) first
+void PrintTimeSummary()
 {
-  char *end;
+    if(!g_timeSummary || g_timeEntries == 0)
+        return;
+    // insertion sort, the table holds one entry per distinct command name
+    for(int i = 1; i < g_timeEntries; i++)
+    {
+        TimeEntry entry = gp_timeTable[i];
+        int j = i - 1;
+        for(; j >= 0 && gp_timeTable[j].real < entry.real; j--)
+            gp_timeTable[j + 1] = gp_timeTable[j];
+        gp_timeTable[j + 1] = entry;
+    }
+    fprintf(stderr, "%-16s %8s %12s %12s %12s %12s %12s %10s %8s %8s\n", "command", "runs", "real_s", "mean_s",
+            "max_s", "user_s", "sys_s", "maxrss_kb", "vcsw", "ivcsw");
+    for(int i = 0; i < g_timeEntries; i++)
+    {
+        TimeEntry *p_entry = &gp_timeTable[i];
+        fprintf(stderr, "%-16s %8ld %12.6f %12.6f %12.6f %12.6f %12.6f %10ld %8ld %8ld\n", p_entry->p_cmd, p_entry->runs,
+                p_entry->real, p_entry->real / p_entry->runs, p_entry->maxReal, p_entry->user, p_entry->sys,
+                p_entry->maxRss, p_entry->nvcsw, p_entry->nivcsw);
+    }
+}
 
-  // Trim leading space
-  while(isspace((unsigned char)*str)) str++;
+int g_child = 0;  // set in children of the shell
 
-  if(*str == 0)  // All spaces?
-    return str;
+void ExitShell(int status)
+{
+    // a child leaves the summary to the shell, and must not let exit() move the batch file offset it shares
+    if(g_child)
+    {
+        fflush(stdout);
+        _exit(status);
+    }
+    PrintTimeSummary();
+    exit(status);
+}
 
-  // Trim trailing space
-  end = str + strlen(str) - 1;
-  while(end > str && isspace((unsigned char)*end)) end--;
+int ExecuteCommand(char **dp_args, int numArgs);
+int ExecuteInProcessCommand(char **dp_args, int numArgs, int index);
+int RunExternalCommand(char *p_path, char **dp_args, int numArgs, int redirectionPos);
+void ExecChild(char *p_path, char **dp_args, int numArgs, int redirectionPos);
+int ExpandArgs(TokenArena *p_out, StringArena *p_strings, char **dp_args, int numArgs, int deferFrom);
 
-  // Write new null terminator character
-  end[1] = '\0';
+// called in every child right after fork(), SIGCHLD is only blocked in the shell itself
+void ChildInit()
+{
+    sigprocmask(SIG_SETMASK, &g_origSigMask, NULL);
+    if(g_sigFd >= 0)
+        close(g_sigFd);
+    g_sigFd = -1;
+    g_numJobs = 0;  // jobs belong to the shell, not to a subshell running a background built-in
+    g_child = 1;
+    if(g_zygoteFd >= 0)  // a subshell forks its commands itself, they must inherit its standard output
+        close(g_zygoteFd);
+    g_zygoteFd = -1;
 
-  return str;
+    // pin and nice, applied once: grandchildren inherit them
+    if(g_launch.numCpus > 0)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        if(g_launch.cpu >= 0)
+            CPU_SET(g_launch.cpu, &cpus);
+        else
+            for(int i = 0; i < g_launch.numCpus; i++)
+                CPU_SET(g_launch.p_cpus[i], &cpus);
+        if(sched_setaffinity(0, sizeof(cpus), &cpus) != 0)  // none of the CPUs is online
+        {
+            PrintError();
+            ExitShell(1);
+        }
+        g_launch.numCpus = 0;
+    }
+    if(g_launch.niced)
+    {
+        // like nice(1), a niceness that cannot be set (raising priority without privilege) does not stop the command
+        errno = 0;
+        g_errorReturn = nice(g_launch.niceIncrement);
+        g_launch.niced = 0;
+    }
 }
 
-int main(int argc, char **argv)
+int ExitStatus(int status)
 {
-    if(argc > 2) // shell invoked with more than one file
-    {
-        PrintError();
-        exit(1);
-    }    
-    FILE *fp;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
 
-    if(argc == 2)  // batch mode
+int AddJob(pid_t pid, char **dp_args, int numArgs)
+{
+    if(g_numJobs == g_jobCapacity)
     {
-        if((fp = fopen(argv[1], "r")) == NULL)  //batch file does not exist
+        g_jobCapacity = (g_jobCapacity == 0) ? ARG_BUFSIZE : 2 * g_jobCapacity;
+        gp_jobs = realloc(gp_jobs, g_jobCapacity * sizeof(Job));
+        if(gp_jobs == NULL)
         {
             PrintError();
             exit(1);
         }
     }
-    
-    char *p_inputLine, **dp_args, *dp_pathDir[32];
-    int builtInCmdNo;
-    
-    // initial default contents of path directory
-    dp_pathDir[0] = strdup("/bin");
-    dp_pathDir[1] = NULL;
+    // keep the command line, the line buffer is reused for the next line
+    size_t length = 1;
+    for(int i = 0; i < numArgs; i++)
+        length += strlen(dp_args[i]) + 1;
+    char *p_cmd = malloc(length);
+    p_cmd[0] = '\0';
+    for(int i = 0; i < numArgs; i++)
+    {
+        if(i > 0)
+            strcat(p_cmd, " ");
+        strcat(p_cmd, dp_args[i]);
+    }
 
-    while(1)
+    Job *p_job = &gp_jobs[g_numJobs];
+    p_job->id = (g_numJobs == 0) ? 1 : gp_jobs[g_numJobs - 1].id + 1;
+    p_job->pid = pid;
+    p_job->state = JOB_RUNNING;
+    p_job->status = 0;
+    p_job->p_cmd = p_cmd;
+    g_numJobs++;
+    return p_job->id;
+}
+
+// a background job was reaped while waiting for any child (parallel loop)
+void MarkJobDone(pid_t pid, int status)
+{
+    for(int i = 0; i < g_numJobs; i++)
     {
-        if(argc == 2) // batch mode
+        if(gp_jobs[i].pid == pid && gp_jobs[i].state == JOB_RUNNING)
         {
-            size_t BUFSIZE = LINE_BUFSIZE;
-            p_inputLine = (char *) malloc(LINE_BUFSIZE * sizeof(char));  // allocating space for the input string
-            if(getline(&p_inputLine, &BUFSIZE, fp) == -1)  // error in reading line
-            {
-                fclose(fp);
-                exit(0);
-            }
+            gp_jobs[i].state = JOB_DONE;
+            gp_jobs[i].status = ExitStatus(status);
         }
-        else  // interactive mode
+    }
+}
+
+void RemoveJob(int index)
+{
+    free(gp_jobs[index].p_cmd);
+    memmove(&gp_jobs[index], &gp_jobs[index + 1], (g_numJobs - index - 1) * sizeof(Job));
+    g_numJobs--;
+}
+
+// collect every background job that has terminated, without blocking
+void ReapJobs()
+{
+    struct signalfd_siginfo info;
+    int signaled = 0;
+    // drain pending SIGCHLD notifications, several children may share one
+    while(g_sigFd >= 0 && read(g_sigFd, &info, sizeof(info)) == sizeof(info))
+        signaled = 1;
+    if(!signaled)  // no child terminated since the last call
+        return;
+
+    for(int i = 0; i < g_numJobs; i++)
+    {
+        int status;
+        struct rusage usage;  // background jobs are not charged to the command being timed
+        if(gp_jobs[i].state == JOB_RUNNING && wait4(gp_jobs[i].pid, &status, WNOHANG, &usage) == gp_jobs[i].pid)
         {
-            // print prompt message by writing into stdin
-            printf("wish> ");
-            p_inputLine = ReadLine();
+            gp_jobs[i].state = JOB_DONE;
+            gp_jobs[i].status = ExitStatus(status);
         }
+    }
+}
 
-        int continueFlag = 0;
-        // handling case where no command is written
-        if((p_inputLine == NULL) || (strcmp(p_inputLine, "\n") == 0))
-            continue;
-        // handling case where input is all whitespaces
-        for(int countWhite = 0; isspace(p_inputLine[countWhite]) != 0; countWhite++)
-            if(countWhite == strlen(p_inputLine) - 1)
-                continueFlag = 1;
-        if(continueFlag == 1)
-            continue;
-        
-        p_inputLine = TrimWhiteSpace(p_inputLine); // remove leading and trailing whitespaces
+void PrintJob(Job *p_job)
+{
+    if(p_job->state == JOB_RUNNING)
+        printf("[%d] Running    %s\n", p_job->id, p_job->p_cmd);
+    else if(p_job->status == 0)
+        printf("[%d] Done    %s\n", p_job->id, p_job->p_cmd);
+    else
+        printf("[%d] Exit %d    %s\n", p_job->id, p_job->status, p_job->p_cmd);
+}
 
-        // parse input line for arguments
-        dp_args = SplitLine(p_inputLine);
-        // handling commands
-        char *p_cmd = strdup(dp_args[0]);
-        builtInCmdNo = IsBuiltInCommand(p_cmd);
-        if(builtInCmdNo > 0)  //built-in command
-        {
-            continueFlag = ExecuteBuiltInCommand(p_cmd, dp_args, dp_pathDir, builtInCmdNo);
-            if(continueFlag == 1)
-                continue;
+// report finished jobs (interactive mode only) and drop them from the job table
+void ReportJobs()
+{
+    if(g_numJobs == 0)
+        return;
+    ReapJobs();
+    for(int i = 0; i < g_numJobs; i++)
+    {
+        if(gp_jobs[i].state == JOB_DONE)
+        {
+            if(g_interactive)
+                PrintJob(&gp_jobs[i]);
+            RemoveJob(i--);
+        }
+    }
+    fflush(stdout);
+}
+
+// jobs built-in: list the job table, finished jobs are listed once
+int ListJobs()
+{
+    ReapJobs();
+    for(int i = 0; i < g_numJobs; i++)
+    {
+        PrintJob(&gp_jobs[i]);
+        if(gp_jobs[i].state == JOB_DONE)
+            RemoveJob(i--);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// wait built-in: block until the given job (or every job) has finished, waited jobs are not reported
+int WaitJobs(char *p_id)
+{
+    int status = 0;
+    int id = -1;
+    if(p_id != NULL)
+    {
+        char *p_end;
+        id = (int) strtol((p_id[0] == '%') ? p_id + 1 : p_id, &p_end, 10);
+        if(*p_end != '\0' || id <= 0)
+        {
+            PrintError();
+            return 1;
         }
-        else  //non built-in command
+    }
+    int found = 0;
+    for(int i = 0; i < g_numJobs; i++)
+    {
+        if(id != -1 && gp_jobs[i].id != id)
+            continue;
+        found = 1;
+        if(gp_jobs[i].state == JOB_RUNNING)
         {
-            // check if command present in the path
-            continueFlag = 1;
-            char p_path[32];
-            continueFlag = CheckCommand(p_path, dp_pathDir, dp_args);
+            int jobStatus;
+            struct rusage usage;
+            if(wait4(gp_jobs[i].pid, &jobStatus, 0, &usage) == gp_jobs[i].pid)
+                gp_jobs[i].status = ExitStatus(jobStatus);
+        }
+        status = gp_jobs[i].status;
+        RemoveJob(i--);
+    }
+    if(id != -1 && !found)  // no such job
+    {
+        PrintError();
+        return 1;
+    }
+    return status;
+}
 
-            // if file not found, print error
-            if(continueFlag == 1)
-            {
-                PrintError();
-                continue;
-            }
+// run a command and report its wall, user and sys time, max RSS and context switches
+// user and sys time add up the children reaped with WaitChild() and the shell itself (in-process built-ins)
+int TimeCommand(char **dp_args, int numArgs, int report)
+{
+    if(g_timing)  // already inside a timed command
+        return ExecuteCommand(dp_args, numArgs);
+    // -T on a line that is already prefixed with time reports the command itself once
+    while(numArgs > 1 && strcmp(dp_args[0], "time") == 0)
+    {
+        dp_args++;
+        numArgs--;
+    }
 
-            // find redirection position in <one or more args> '>' <filename>
-            int redirectionPos = -1, countArgs = 0;
-            for(int i = 0; dp_args[i] != NULL; i++)
-            {
-                countArgs++;
-                if(redirectionPos != -1)
-                    continue;
-                if(strcmp(dp_args[i], ">") == 0)
-                    redirectionPos = i;
-            }
-            // illegal redirection position
-            if(redirectionPos != -1 && redirectionPos != countArgs - 2)
-            {
-                PrintError();
-                continue;
-            }
-            int pid = fork();
-            if(pid == 0)  // non-builtin commands run in child process
-            {
-                if(redirectionPos == -1)  // no redirection
-                {
-                    execv(p_path, dp_args);
+    struct timespec start, end;
+    struct rusage selfStart, selfEnd;
+    memset(&g_childUsage, 0, sizeof(g_childUsage));
+    g_timing = 1;
+    getrusage(RUSAGE_SELF, &selfStart);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int status = ExecuteCommand(dp_args, numArgs);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    getrusage(RUSAGE_SELF, &selfEnd);
+    g_timing = 0;
+
+    double real = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double user = Seconds(g_childUsage.ru_utime) + Seconds(selfEnd.ru_utime) - Seconds(selfStart.ru_utime);
+    double sys = Seconds(g_childUsage.ru_stime) + Seconds(selfEnd.ru_stime) - Seconds(selfStart.ru_stime);
+    long maxRss = (g_childUsage.ru_maxrss > 0) ? g_childUsage.ru_maxrss : selfEnd.ru_maxrss;
+    long nvcsw = g_childUsage.ru_nvcsw + selfEnd.ru_nvcsw - selfStart.ru_nvcsw;
+    long nivcsw = g_childUsage.ru_nivcsw + selfEnd.ru_nivcsw - selfStart.ru_nivcsw;
+
+    if(report)
+    {
+        fprintf(stderr, "time: real=%.6f user=%.6f sys=%.6f maxrss_kb=%ld vcsw=%ld ivcsw=%ld status=%d cmd=",
+                real, user, sys, maxRss, nvcsw, nivcsw, status);
+        for(int i = 0; i < numArgs; i++)
+            fprintf(stderr, (i == 0) ? "%s" : " %s", dp_args[i]);
+        fprintf(stderr, "\n");
+    }
+    if(g_timeSummary)
+        AddTimeEntry(dp_args[0], real, user, sys, maxRss, nvcsw, nivcsw);
+    return status;
+}
+
+// parse a CPU list such as 0-3,8,10-11 into *dp_cpus, returns the number of CPUs or -1
+int ParseCpuList(char *p_list, int **dp_cpus)
+{
+    int numCpus = 0, capacity = 0;
+    *dp_cpus = NULL;
+    while(*p_list != '\0')
+    {
+        char *p_end;
+        long first = strtol(p_list, &p_end, 10), last;
+        if(p_end == p_list || first < 0 || first >= CPU_SETSIZE)
+            break;
+        last = first;
+        if(*p_end == '-')
+        {
+            p_list = p_end + 1;
+            last = strtol(p_list, &p_end, 10);
+            if(p_end == p_list || last < first || last >= CPU_SETSIZE)
+                break;
+        }
+        for(long cpu = first; cpu <= last; cpu++)
+        {
+            if(numCpus == capacity)
+            {
+                capacity = (capacity == 0) ? ARG_BUFSIZE : 2 * capacity;
+                *dp_cpus = realloc(*dp_cpus, capacity * sizeof(int));
+                if(*dp_cpus == NULL)
+                {
                     PrintError();
                     exit(1);
                 }
-                else  // redirection present
+            }
+            (*dp_cpus)[numCpus++] = (int) cpu;
+        }
+        if(*p_end == '\0')
+            return numCpus;
+        if(*p_end != ',')
+            break;
+        p_list = p_end + 1;
+    }
+    free(*dp_cpus);
+    *dp_cpus = NULL;
+    return -1;
+}
+
+int ExecuteBuiltInCommand(char **dp_args, int cmdNo);
+int SourceScript(char *p_file);
+
+// loop [-p] <count> <command> ...
+// -p runs iterations concurrently, one per CPU given to pin (or per online CPU); a pinned loop puts
+// iteration i on the i-th CPU round-robin (the first free one when running concurrently)
+int ExecuteLoop(char **dp_args)
+{
+    int loopCount, parallel = 0, first = 1;
+    if(dp_args[1] != NULL && strcmp(dp_args[1], "-p") == 0)
+    {
+        parallel = 1;
+        first = 2;
+    }
+    if(dp_args[first] == NULL)
+    {
+        PrintError();
+        return 1;
+    }
+    else
+    {
+        loopCount = atoi(dp_args[first]);
+        if(loopCount <= 0)
+        {
+            PrintError();
+            return 1;
+        }
+    }
+    if(dp_args[first + 1] == NULL)  // nothing to loop over
+        return 0;
+    char p_loopCmdPath[PATH_MAX];
+    char p_loopCounter[16];  // text of the loop counter, shared by every $loop of an iteration
+    int numSlots = 1;  // iterations running at once
+    if(parallel)
+        numSlots = (g_launch.numCpus > 0) ? g_launch.numCpus : (int) sysconf(_SC_NPROCESSORS_ONLN);
+    if(numSlots < 1)
+        numSlots = 1;
+    pid_t *p_slots = calloc(numSlots, sizeof(pid_t));  // child running in each slot, 0 if free
+    int running = 0, savedCpu = g_launch.cpu;
+    int launchOpts = (g_launch.numCpus > 0 || g_launch.niced);
+    for(int i = 0; i < loopCount; i++)
+    {
+        // replace $loop occurences with counter
+        snprintf(p_loopCounter, sizeof(p_loopCounter), "%d", i + 1);
+        ResetTokens(&g_loopTokens);
+        ResetStrings(&g_loopStrings);
+        int substitute = 0;
+        for(int j = first + 1; dp_args[j] != NULL; j++)
+        {
+            if(strcmp(dp_args[j], "$loop") == 0)
+                PushToken(&g_loopTokens, p_loopCounter);
+            else if(strstr(dp_args[j], "$(") != NULL)
+            {
+                // $loop inside a command substitution is replaced before the substitution runs
+                char *p_arg = dp_args[j], *p_var;
+                size_t length = 0;
+                while((p_var = strstr(p_arg, "$loop")) != NULL)
+                {
+                    length += (p_var - p_arg) + strlen(p_loopCounter);
+                    p_arg = p_var + 5;
+                }
+                length += strlen(p_arg);
+                char *p_word = CopyString(&g_loopStrings, "", length), *p_dst = p_word;
+                for(p_arg = dp_args[j]; (p_var = strstr(p_arg, "$loop")) != NULL; p_arg = p_var + 5)
                 {
-                    char p_filename[128];
-                    strcpy(p_filename, dp_args[countArgs - 1]);
-                    int fd_out = open(p_filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-                    int fd_err = open(p_filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
-                    if(fd_out < 0 || fd_err < 0)
-                    {
-                        PrintError();
-                        exit(1);    
-                    }
-                    
-                    int dup2_out = dup2(fd_out, STDOUT_FILENO);
-                    int dup2_err = dup2(fd_err, STDERR_FILENO);
-                    if(dup2_out < 0 || dup2_err < 0)
-                    {
-                        PrintError();
-                        exit(1);   
-                    }
+                    memcpy(p_dst, p_arg, p_var - p_arg);
+                    p_dst += p_var - p_arg;
+                    p_dst = stpcpy(p_dst, p_loopCounter);
+                }
+                strcpy(p_dst, p_arg);
+                PushToken(&g_loopTokens, p_word);
+                substitute = 1;
+            }
+            else
+                PushToken(&g_loopTokens, dp_args[j]);
+        }
+        TokenArena *p_iteration = &g_loopTokens;
+        if(substitute)
+        {
+            if(ExpandArgs(&g_loopExpandTokens, &g_loopStrings, g_loopTokens.dp_tokens, g_loopTokens.numTokens,
+                          g_loopTokens.numTokens) != 0 || g_loopExpandTokens.numTokens == 0)
+            {
+                PrintError();
+                continue;
+            }
+            p_iteration = &g_loopExpandTokens;
+        }
+        // built-ins (source a script, cd, ...) run in the shell itself, even with -p
+        int loopCmdNo = IsBuiltInCommand(p_iteration->dp_tokens[0]);
+        if(loopCmdNo > 0 && loopCmdNo <= NUM_BUILTIN_CMDS)
+        {
+            ExecuteBuiltInCommand(p_iteration->dp_tokens, loopCmdNo);
+            continue;
+        }
+        // loop does not redirect, so only plain in-process commands skip the fork (a pinned or niced one forks)
+        if(loopCmdNo > NUM_BUILTIN_CMDS && !launchOpts)
+        {
+            int redirected = 0;
+            for(int j = 0; j < p_iteration->numTokens; j++)
+                redirected |= (strcmp(p_iteration->dp_tokens[j], ">") == 0);
+            if(!redirected)
+            {
+                ExecuteInProcessCommand(p_iteration->dp_tokens, p_iteration->numTokens,
+                                        loopCmdNo - NUM_BUILTIN_CMDS - 1);
+                continue;
+            }
+        }
+        // loop passes '>' on as an argument, it does not redirect
+        if(CheckCommand(p_loopCmdPath, g_pathDir.dp_tokens, p_iteration->dp_tokens) != 0)
+        {
+            PrintError();
+            continue;
+        }
+        if(!parallel)
+        {
+            if(g_launch.numCpus > 0)
+                g_launch.cpu = g_launch.p_cpus[i % g_launch.numCpus];
+            RunExternalCommand(p_loopCmdPath, p_iteration->dp_tokens, p_iteration->numTokens, -1);
+            continue;
+        }
+
+        /* wait for a free slot: find the next child to exit without reaping it (WNOWAIT), then reap it; only the
+        iterations are reaped with WaitChild() and charged to a timed loop, a background job that exits meanwhile
+        is reaped on its own and marked done in the job table */
+        while(running == numSlots)
+        {
+            siginfo_t info;
+            if(waitid(P_ALL, 0, &info, WEXITED | WNOWAIT) < 0)
+            {
+                PrintError();
+                exit(1);
+            }
+            int slot, status;
+            for(slot = 0; slot < numSlots && p_slots[slot] != info.si_pid; slot++);
+            if(slot == numSlots)
+            {
+                if(waitpid(info.si_pid, &status, 0) == info.si_pid)
+                    MarkJobDone(info.si_pid, status);
+            }
+            else
+            {
+                WaitChild(p_slots[slot], NULL);
+                p_slots[slot] = 0;
+                running--;
+            }
+        }
+        int slot;
+        for(slot = 0; p_slots[slot] != 0; slot++);
+        if(g_launch.numCpus > 0)
+            g_launch.cpu = g_launch.p_cpus[slot];
+        pid_t pid = fork();
+        if(pid < 0)
+        {
+            PrintError();
+            exit(1);
+        }
+        else if(pid == 0)
+            ExecChild(p_loopCmdPath, p_iteration->dp_tokens, p_iteration->numTokens, -1);
+        p_slots[slot] = pid;
+        running++;
+    }
+    // wait for the iterations still running
+    for(int slot = 0; slot < numSlots; slot++)
+        if(p_slots[slot] != 0)
+            WaitChild(p_slots[slot], NULL);
+    free(p_slots);
+    g_launch.cpu = savedCpu;
+    return 0;
+}
+
+// pin <cpulist> <command> ... and nice [-n] <increment> <command> ...
+// run the command with launch options that every child started for it applies
+int ExecuteLaunchPrefix(char **dp_args, int numArgs, int cmdNo)
+{
+    int first = (cmdNo == 10 && numArgs > 1 && strcmp(dp_args[1], "-n") == 0) ? 2 : 1;
+    if(numArgs < first + 2)  // nothing to run
+    {
+        PrintError();
+        return 1;
+    }
+    LaunchOpts saved = g_launch;
+    int *p_cpus = NULL;
+    if(cmdNo == 9)
+    {
+        int numCpus = ParseCpuList(dp_args[first], &p_cpus);
+        if(numCpus <= 0)
+        {
+            PrintError();
+            return 1;
+        }
+        g_launch.numCpus = numCpus;
+        g_launch.p_cpus = p_cpus;
+        g_launch.cpu = -1;
+    }
+    else
+    {
+        char *p_end;
+        long increment = strtol(dp_args[first], &p_end, 10);
+        if(p_end == dp_args[first] || *p_end != '\0')
+        {
+            PrintError();
+            return 1;
+        }
+        g_launch.niced = 1;
+        g_launch.niceIncrement += (int) increment;
+    }
+    int status = ExecuteCommand(dp_args + first + 1, numArgs - first - 1);
+    free(p_cpus);
+    g_launch = saved;
+    return status;
+}
 
-                    // arguments including > and filename have to be removed
-                    dp_args[countArgs - 1] = NULL;
-                    dp_args[countArgs - 2] = NULL;
+int ExecuteBuiltInCommand(char **dp_args, int cmdNo)
+{
+    int countArgs;
 
-                    execv(p_path, dp_args);
+    switch(cmdNo)
+    {
+        // exit
+        case 1:
+            if(dp_args[1] != NULL)  // incorrect number of arguments
+            {
+                // print error message
+                PrintError();
+                return 1;
+            }
+            ExitShell(0);
+        // cd
+        case 2:
+            // early exit condition
+            if(dp_args[1] == NULL)  // incorrect number of arguments (0)
+            {
+                PrintError();
+                return 1;
+            }
+            else if(dp_args[2] != NULL)  // incorrect number of arguments (>1)
+            {
+                PrintError();
+                return 1;
+            }
+            else
+            {
+                // if chdir did not succeed
+                if(chdir(dp_args[1]) != 0)
+                {
                     PrintError();
-                    exit(1);
+                    return 1;
                 }
+                g_resolveGen++;  // relative PATH directories now point elsewhere
+                return 0;
+            }
+        // path
+        case 3:
+            // overwriting path directory with passed arguments
+            // arguments live in the line buffer which is reused for the next line, so the path keeps its own copies
+            for(countArgs = 0; countArgs < g_pathDir.numTokens; countArgs++)
+                free(g_pathDir.dp_tokens[countArgs]);
+            ResetTokens(&g_pathDir);
+            for(countArgs = 1; dp_args[countArgs] != NULL; countArgs++)
+                PushToken(&g_pathDir, strdup(dp_args[countArgs]));
+            g_resolveGen++;
+            return 0;
+
+        // loop
+        case 4:
+            return ExecuteLoop(dp_args);
+
+        // time
+        case 5:
+            if(dp_args[1] == NULL)  // nothing to time
+            {
+                PrintError();
+                return 1;
+            }
+            for(countArgs = 1; dp_args[countArgs] != NULL; countArgs++);
+            return TimeCommand(dp_args + 1, countArgs - 1, 1);
+
+        // jobs
+        case 6:
+            if(dp_args[1] != NULL)
+            {
+                PrintError();
+                return 1;
+            }
+            return ListJobs();
+
+        // wait
+        case 7:
+            if(dp_args[1] != NULL && dp_args[2] != NULL)
+            {
+                PrintError();
+                return 1;
             }
-            else if(pid > 0)  // parent, wait for child to complete its process
+            return WaitJobs(dp_args[1]);
+
+        // inproc
+        case 8:
+            // overwriting the set of in-process commands with passed arguments
+            for(countArgs = 1; dp_args[countArgs] != NULL; countArgs++)
             {
-                if((int) wait(NULL) != pid)
+                int known = 0;
+                for(int i = 0; i < g_numInProcCmds; i++)
+                    known |= (strcmp(dp_args[countArgs], g_inProcCmds[i].p_name) == 0);
+                if(!known)  // no in-process implementation
                 {
                     PrintError();
-                    exit(1);                   
+                    return 1;
                 }
             }
-            else  // error in forking 
+            for(int i = 0; i < g_numInProcCmds; i++)
+            {
+                g_inProcCmds[i].enabled = 0;
+                for(countArgs = 1; dp_args[countArgs] != NULL; countArgs++)
+                    if(strcmp(dp_args[countArgs], g_inProcCmds[i].p_name) == 0)
+                        g_inProcCmds[i].enabled = 1;
+            }
+            g_resolveGen++;
+            return 0;
+
+        // pin
+        case 9:
+        // nice
+        case 10:
+            for(countArgs = 0; dp_args[countArgs] != NULL; countArgs++);
+            return ExecuteLaunchPrefix(dp_args, countArgs, cmdNo);
+
+        // source
+        case 11:
+            if(dp_args[1] == NULL || dp_args[2] != NULL)  // exactly one script
             {
                 PrintError();
-                exit(1);
+                return 1;
+            }
+            return SourceScript(dp_args[1]);
+
+        // in-process commands
+        default:
+            for(countArgs = 0; dp_args[countArgs] != NULL; countArgs++);
+            return ExecuteInProcessCommand(dp_args, countArgs, cmdNo - NUM_BUILTIN_CMDS - 1);
+    }
+    return 0;
+}
+
+char *TrimWhiteSpace(char *str)
+{
+  char *end;
+
+  // Trim leading space
+  while(isspace((unsigned char)*str)) str++;
+
+  if(*str == 0)  // All spaces?
+    return str;
+
+  // Trim trailing space
+  end = str + strlen(str) - 1;
+  while(end > str && isspace((unsigned char)*end)) end--;
+
+  // Write new null terminator character
+  end[1] = '\0';
+
+  return str;
+}
+
+// look up a non built-in command in PATH and validate its redirection
+// p_path receives the executable, returns the position of '>' (-1 if none) or -2 if the command cannot run
+int PrepareExternalCommand(char *p_path, char **dp_args, int numArgs)
+{
+    // check if command present in the path
+    // if file not found, print error
+    if(CheckCommand(p_path, g_pathDir.dp_tokens, dp_args) == 1)
+    {
+        PrintError();
+        return -2;
+    }
+
+    // find redirection position in <one or more args> '>' <filename>
+    int redirectionPos = -1;
+    for(int i = 0; dp_args[i] != NULL; i++)
+    {
+        if(strcmp(dp_args[i], ">") == 0)
+        {
+            redirectionPos = i;
+            break;
+        }
+    }
+    // illegal redirection position
+    if(redirectionPos != -1 && redirectionPos != numArgs - 2)
+    {
+        PrintError();
+        return -2;
+    }
+    return redirectionPos;
+}
+
+// child side of a non built-in command, sets up redirection and never returns
+void ExecChild(char *p_path, char **dp_args, int numArgs, int redirectionPos)
+{
+    ChildInit();
+    if(redirectionPos == -1)  // no redirection
+    {
+        execv(p_path, dp_args);
+        PrintError();
+        ExitShell(1);
+    }
+    else  // redirection present
+    {
+        // standard output and standard error share one open file, so their writes do not overwrite each other
+        char *p_filename = dp_args[numArgs - 1];
+        int fd_out = open(p_filename, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+        if(fd_out < 0)
+        {
+            PrintError();
+            ExitShell(1);
+        }
+
+        int dup2_out = dup2(fd_out, STDOUT_FILENO);
+        int dup2_err = dup2(fd_out, STDERR_FILENO);
+        if(dup2_out < 0 || dup2_err < 0)
+        {
+            PrintError();
+            ExitShell(1);
+        }
+
+        // arguments including > and filename have to be removed
+        dp_args[numArgs - 1] = NULL;
+        dp_args[numArgs - 2] = NULL;
+
+        execv(p_path, dp_args);
+        PrintError();
+        ExitShell(1);
+    }
+}
+
+int WriteAll(int fd, char *p_buf, size_t length);
+
+int ReadAll(int fd, void *p_buf, size_t length)
+{
+    char *p_dst = p_buf;
+    while(length > 0)
+    {
+        ssize_t bytes = read(fd, p_dst, length);
+        if(bytes < 0 && errno == EINTR)
+            continue;
+        if(bytes <= 0)  // error or end of file
+            return -1;
+        p_dst += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+// fork server loop, never returns; the helper exits when the shell closes its end of the socketpair
+void RunZygote(int fd)
+{
+    char *p_payload = NULL;
+    size_t payloadSize = 0;
+    ZygoteRequest request;
+    while(ReadAll(fd, &request, sizeof(request)) == 0)
+    {
+        if(request.length > payloadSize)
+        {
+            payloadSize = request.length;
+            if((p_payload = realloc(p_payload, payloadSize)) == NULL)
+                break;
+        }
+        if(ReadAll(fd, p_payload, request.length) != 0)
+            break;
+        char *p_cwd = p_payload + request.numCpus * sizeof(int);
+        char *p_path = p_cwd + strlen(p_cwd) + 1;
+        char *p_arg = p_path + strlen(p_path) + 1;
+        ResetTokens(&g_lineTokens);
+        for(int i = 0; i < request.numArgs; i++)
+        {
+            PushToken(&g_lineTokens, p_arg);
+            p_arg += strlen(p_arg) + 1;
+        }
+        g_launch.numCpus = request.numCpus;
+        g_launch.p_cpus = (int *) p_payload;
+        g_launch.cpu = request.cpu;
+        g_launch.niced = request.niced;
+        g_launch.niceIncrement = request.niceIncrement;
+
+        ZygoteReply reply;
+        memset(&reply, 0, sizeof(reply));
+        int execFds[2] = {-1, -1};  // tracing: closed by a successful exec, like in RunExternalCommand
+        if(request.trace && pipe2(execFds, O_CLOEXEC) != 0)
+            execFds[0] = execFds[1] = -1;
+        reply.pid = fork();
+        if(reply.pid == 0)
+        {
+            close(fd);
+            if(execFds[0] >= 0)
+                close(execFds[0]);
+            if(chdir(p_cwd) != 0)
+            {
+                PrintError();
+                ExitShell(1);
             }
+            ExecChild(p_path, g_lineTokens.dp_tokens, request.numArgs, request.redirectionPos);
         }
+        if(execFds[0] >= 0)
+        {
+            struct timespec now;
+            char byte;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            reply.forkEnd = now.tv_sec * 1000000000LL + now.tv_nsec;
+            close(execFds[1]);
+            while(reply.pid > 0 && read(execFds[0], &byte, 1) < 0 && errno == EINTR);
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            reply.execEnd = now.tv_sec * 1000000000LL + now.tv_nsec;
+            close(execFds[0]);
+        }
+        if(reply.pid < 0 || WriteAll(fd, (char *) &reply, sizeof(reply)) != 0)
+            break;
+        while(wait4(reply.pid, &reply.status, 0, &reply.usage) < 0 && errno == EINTR);
+        reply.exited = 1;
+        if(WriteAll(fd, (char *) &reply, sizeof(reply)) != 0)
+            break;
+    }
+    ExitShell(0);
+}
+
+// start the fork server, commands are forked by the shell itself if it cannot be started
+void StartZygote()
+{
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+        return;
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if(pid == 0)
+    {
+        close(fds[0]);
+        if(g_sigFd >= 0)
+            close(g_sigFd);
+        g_sigFd = -1;
+        g_child = 1;
+        RunZygote(fds[1]);
+    }
+    close(fds[1]);
+    g_zygoteFd = fds[0];
+}
+
+// run a resolved non built-in command through the fork server and return its exit status
+int RunZygoteCommand(char *p_path, char **dp_args, int numArgs, int redirectionPos)
+{
+    static char *p_payload = NULL;  // request buffer reused between commands
+    static size_t payloadSize = 0;
+    char p_cwd[PATH_MAX];
+    if(getcwd(p_cwd, sizeof(p_cwd)) == NULL)
+    {
+        PrintError();
+        return 1;
+    }
+    ZygoteRequest request;
+    request.numArgs = numArgs;
+    request.redirectionPos = redirectionPos;
+    request.numCpus = g_launch.numCpus;
+    request.cpu = g_launch.cpu;
+    request.niced = g_launch.niced;
+    request.niceIncrement = g_launch.niceIncrement;
+    request.trace = (g_traceFd >= 0);
+    request.length = g_launch.numCpus * sizeof(int) + strlen(p_cwd) + 1 + strlen(p_path) + 1;
+    for(int i = 0; i < numArgs; i++)
+        request.length += strlen(dp_args[i]) + 1;
+    if(sizeof(request) + request.length > payloadSize)
+    {
+        payloadSize = 2 * (sizeof(request) + request.length);
+        if((p_payload = realloc(p_payload, payloadSize)) == NULL)
+        {
+            PrintError();
+            exit(1);
+        }
+    }
+    char *p_dst = p_payload;
+    memcpy(p_dst, &request, sizeof(request));
+    p_dst += sizeof(request);
+    memcpy(p_dst, g_launch.p_cpus, g_launch.numCpus * sizeof(int));
+    p_dst += g_launch.numCpus * sizeof(int);
+    p_dst = stpcpy(p_dst, p_cwd) + 1;
+    p_dst = stpcpy(p_dst, p_path) + 1;
+    for(int i = 0; i < numArgs; i++)
+        p_dst = stpcpy(p_dst, dp_args[i]) + 1;
+
+    ZygoteReply reply;
+    g_trace.forkStart = TraceNow();
+    if(WriteAll(g_zygoteFd, p_payload, p_dst - p_payload) != 0 || ReadAll(g_zygoteFd, &reply, sizeof(reply)) != 0)
+    {
+        // the fork server is gone, the shell forks commands itself from now on
+        PrintError();
+        close(g_zygoteFd);
+        g_zygoteFd = -1;
+        return 1;
+    }
+    // the fork server stamps the fork and the exec, the clock is the same in every process
+    g_trace.forkEnd = reply.forkEnd;
+    g_trace.execEnd = reply.execEnd;
+    if(ReadAll(g_zygoteFd, &reply, sizeof(reply)) != 0)
+    {
+        PrintError();
+        exit(1);
+    }
+    AddChildUsage(&reply.usage);
+    g_trace.exit = TraceNow();
+    TraceCommand(dp_args[0], "exec", reply.pid, ExitStatus(reply.status));
+    return ExitStatus(reply.status);
+}
+
+// run a resolved non built-in command in a child process and return its exit status
+int RunExternalCommand(char *p_path, char **dp_args, int numArgs, int redirectionPos)
+{
+    if(g_zygoteFd >= 0)
+        return RunZygoteCommand(p_path, dp_args, numArgs, redirectionPos);
+
+    int execFds[2] = {-1, -1};  // tracing: closed by a successful exec, which the shell sees as end of file
+    if(g_traceFd >= 0 && pipe2(execFds, O_CLOEXEC) != 0)
+        execFds[0] = execFds[1] = -1;
+    g_trace.forkStart = TraceNow();
+    pid_t pid = fork();
+    if(pid == 0)  // non-builtin commands run in child process
+    {
+        if(execFds[0] >= 0)
+            close(execFds[0]);
+        ExecChild(p_path, dp_args, numArgs, redirectionPos);
+    }
+    else if(pid > 0)  // parent, wait for child to complete its process
+    {
+        int status;
+        g_trace.forkEnd = TraceNow();
+        if(execFds[0] >= 0)
+        {
+            char byte;
+            close(execFds[1]);
+            while(read(execFds[0], &byte, 1) < 0 && errno == EINTR);
+            g_trace.execEnd = TraceNow();
+            close(execFds[0]);
+        }
+        if(WaitChild(pid, &status) != pid)
+        {
+            PrintError();
+            exit(1);
+        }
+        g_trace.exit = TraceNow();
+        TraceCommand(dp_args[0], "exec", pid, ExitStatus(status));
+        return ExitStatus(status);
+    }
+    // error in forking
+    PrintError();
+    exit(1);
+}
+
+// run a non built-in command in a child process and return its exit status
+int ExecuteExternalCommand(char **dp_args, int numArgs)
+{
+    char p_path[PATH_MAX];
+    int redirectionPos = PrepareExternalCommand(p_path, dp_args, numArgs);
+    if(redirectionPos == -2)
+        return 1;
+    return RunExternalCommand(p_path, dp_args, numArgs, redirectionPos);
+}
+
+// write all of a buffer, in-process commands report write errors like the real ones do
+int WriteAll(int fd, char *p_buf, size_t length)
+{
+    while(length > 0)
+    {
+        ssize_t bytes = write(fd, p_buf, length);
+        if(bytes < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p_buf += bytes;
+        length -= bytes;
+    }
+    return 0;
+}
+
+// coreutils treats a lone --help or --version as an option, the real executable handles those
+int IsHelpOrVersion(char **dp_args, int numArgs)
+{
+    return numArgs == 2 && (strcmp(dp_args[1], "--help") == 0 || strcmp(dp_args[1], "--version") == 0);
+}
+
+int RunEcho(char **dp_args, int numArgs, int outFd, int errFd)
+{
+    static char *p_buf = NULL;  // output line, reused between calls
+    static size_t bufSize = 0;
+    int newline = 1, first = 1;
+
+    if(IsHelpOrVersion(dp_args, numArgs))
+        return -1;
+    // leading -n options suppress the newline, -e and -E are left to the real echo
+    for(; first < numArgs && dp_args[first][0] == '-' && dp_args[first][1] != '\0'; first++)
+    {
+        if(dp_args[first][strspn(dp_args[first] + 1, "neE") + 1] != '\0')  // not an option, an argument
+            break;
+        if(dp_args[first][strspn(dp_args[first] + 1, "n") + 1] != '\0')
+            return -1;
+        newline = 0;
+    }
+
+    size_t length = 0;
+    for(int i = first; i < numArgs; i++)
+        length += strlen(dp_args[i]) + 1;
+    if(length + 1 > bufSize)
+    {
+        bufSize = (length + 1 > LINE_BUFSIZE) ? length + 1 : LINE_BUFSIZE;
+        free(p_buf);
+        p_buf = malloc(bufSize);
+    }
+    length = 0;
+    for(int i = first; i < numArgs; i++)
+    {
+        size_t argLength = strlen(dp_args[i]);
+        if(i > first)
+            p_buf[length++] = ' ';
+        memcpy(p_buf + length, dp_args[i], argLength);
+        length += argLength;
+    }
+    if(newline)
+        p_buf[length++] = '\n';
+    return (WriteAll(outFd, p_buf, length) == 0) ? 0 : 1;
+}
+
+int RunTrue(char **dp_args, int numArgs, int outFd, int errFd)
+{
+    if(IsHelpOrVersion(dp_args, numArgs))
+        return -1;
+    return 0;
+}
+
+int RunPwd(char **dp_args, int numArgs, int outFd, int errFd)
+{
+    char p_cwd[PATH_MAX + 1];
+    if(numArgs > 1)  // options and their warnings are left to the real pwd
+        return -1;
+    if(getcwd(p_cwd, PATH_MAX) == NULL)
+        return -1;
+    size_t length = strlen(p_cwd);
+    p_cwd[length++] = '\n';
+    return (WriteAll(outFd, p_cwd, length) == 0) ? 0 : 1;
+}
+
+int RunCat(char **dp_args, int numArgs, int outFd, int errFd)
+{
+    static char *p_buf = NULL;  // copy buffer, reused between calls
+    char p_message[PATH_MAX + 128];
+    int status = 0;
+    struct stat outStat;
+
+    // no file (standard input) and options are left to the real cat
+    if(numArgs < 2)
+        return -1;
+    for(int i = 1; i < numArgs; i++)
+        if(dp_args[i][0] == '-')
+            return -1;
+    if(p_buf == NULL && (p_buf = malloc(IO_BUFSIZE)) == NULL)
+        return -1;
+    int outRegular = (fstat(outFd, &outStat) == 0 && S_ISREG(outStat.st_mode));
+
+    for(int i = 1; i < numArgs; i++)
+    {
+        struct stat inStat;
+        int fd = open(dp_args[i], O_RDONLY);
+        if(fd < 0)
+        {
+            snprintf(p_message, sizeof(p_message), "%s: %s: %s\n", dp_args[0], dp_args[i], strerror(errno));
+            WriteAll(errFd, p_message, strlen(p_message));
+            status = 1;
+            continue;
+        }
+        if(outRegular && fstat(fd, &inStat) == 0 && inStat.st_dev == outStat.st_dev && inStat.st_ino == outStat.st_ino
+           && inStat.st_size > 0)  // reading it would never end, an empty one is harmless
+        {
+            snprintf(p_message, sizeof(p_message), "%s: %s: input file is output file\n", dp_args[0], dp_args[i]);
+            WriteAll(errFd, p_message, strlen(p_message));
+            status = 1;
+            close(fd);
+            continue;
+        }
+        ssize_t bytes;
+        while((bytes = read(fd, p_buf, IO_BUFSIZE)) > 0)
+        {
+            if(WriteAll(outFd, p_buf, bytes) < 0)
+            {
+                snprintf(p_message, sizeof(p_message), "%s: write error: %s\n", dp_args[0], strerror(errno));
+                WriteAll(errFd, p_message, strlen(p_message));
+                close(fd);
+                return 1;
+            }
+        }
+        if(bytes < 0)
+        {
+            snprintf(p_message, sizeof(p_message), "%s: %s: %s\n", dp_args[0], dp_args[i], strerror(errno));
+            WriteAll(errFd, p_message, strlen(p_message));
+            status = 1;
+        }
+        close(fd);
+    }
+    return status;
+}
+
+// the resolved executable is the one an in-process command stands in for
+int IsSystemBinary(char *p_path, char *p_name)
+{
+    char *p_dirs[] = {"/bin/", "/usr/bin/"};
+    for(int i = 0; i < 2; i++)
+    {
+        size_t length = strlen(p_dirs[i]);
+        if(strncmp(p_path, p_dirs[i], length) != 0)
+            continue;
+        p_path += length;
+        while(*p_path == '/')  // a path directory given with a trailing '/'
+            p_path++;
+        return strcmp(p_path, p_name) == 0;
+    }
+    return 0;
+}
+
+// run an in-process command with the same lookup, redirection and exit status as its executable
+int ExecuteInProcessCommand(char **dp_args, int numArgs, int index)
+{
+    char p_path[PATH_MAX];
+    int redirectionPos = PrepareExternalCommand(p_path, dp_args, numArgs);
+    if(redirectionPos == -2)
+        return 1;
+    // shadowed by another executable in PATH, or pinned/niced (only a child can be)
+    if(!IsSystemBinary(p_path, g_inProcCmds[index].p_name) || g_launch.numCpus > 0 || g_launch.niced)
+        return RunExternalCommand(p_path, dp_args, numArgs, redirectionPos);
+
+    int fd = STDOUT_FILENO, errFd = STDERR_FILENO;
+    int status;
+    if(redirectionPos != -1)
+    {
+        // same as the child of a non built-in command: the file is created (and truncated) before running
+        if((fd = open(dp_args[numArgs - 1], O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0644)) < 0)
+        {
+            PrintError();
+            return 1;
+        }
+        errFd = fd;
+        dp_args[numArgs - 2] = NULL;
+        status = g_inProcCmds[index].p_run(dp_args, numArgs - 2, fd, errFd);
+        dp_args[numArgs - 2] = ">";
+        close(fd);
+    }
+    else
+        status = g_inProcCmds[index].p_run(dp_args, numArgs, fd, errFd);
+    if(status == -1)  // not implemented in-process, the executable runs (and writes the file again from scratch)
+        return RunExternalCommand(p_path, dp_args, numArgs, redirectionPos);
+    g_trace.exit = TraceNow();
+    TraceCommand(dp_args[0], "inproc", getpid(), status);
+    return status;
+}
+
+// run a parsed command line, built-in or not, and return its status
+int ExecuteCommand(char **dp_args, int numArgs)
+{
+    // handling commands
+    int builtInCmdNo = IsBuiltInCommand(dp_args[0]);
+    if(builtInCmdNo > 0)  //built-in command
+        return ExecuteBuiltInCommand(dp_args, builtInCmdNo);
+    else  //non built-in command
+        return ExecuteExternalCommand(dp_args, numArgs);
+}
+
+// start a command as a background job, built-in commands run in a subshell
+int ExecuteBackgroundCommand(char **dp_args, int numArgs)
+{
+    char p_path[PATH_MAX];
+    int redirectionPos = -1;
+    int builtInCmdNo = IsBuiltInCommand(dp_args[0]);
+    if(builtInCmdNo == 0 && (redirectionPos = PrepareExternalCommand(p_path, dp_args, numArgs)) == -2)
+        return 1;
+
+    pid_t pid = fork();
+    if(pid == 0)
+    {
+        if(builtInCmdNo == 0)
+            ExecChild(p_path, dp_args, numArgs, redirectionPos);
+        ChildInit();
+        ExitShell(ExecuteBuiltInCommand(dp_args, builtInCmdNo));
+    }
+    else if(pid < 0)
+    {
+        PrintError();
+        exit(1);
+    }
+    int id = AddJob(pid, dp_args, numArgs);
+    if(g_interactive)
+    {
+        printf("[%d] %d\n", id, (int) pid);
+        fflush(stdout);
+    }
+    return 0;
+}
+
+int ExecuteLine(char **dp_args, int numArgs);
+
+// child side of a parsed line, non built-in commands are exec'd directly instead of forking once more
+void RunLineAndExit(char **dp_args, int numArgs)
+{
+    int substitute = 0;
+    for(int i = 0; i < numArgs; i++)
+        substitute |= (strstr(dp_args[i], "$(") != NULL);
+    if(numArgs > 0 && !substitute && !g_timeAll && strncmp(dp_args[0], "after:", 6) != 0
+       && IsBuiltInCommand(dp_args[0]) == 0)
+    {
+        char p_path[PATH_MAX];
+        int redirectionPos = PrepareExternalCommand(p_path, dp_args, numArgs);
+        if(redirectionPos == -2)
+            ExitShell(1);
+        ExecChild(p_path, dp_args, numArgs, redirectionPos);
+    }
+    ExitShell((numArgs > 0) ? ExecuteLine(dp_args, numArgs) : 0);
+}
+
+// run a command line with its standard output on a pipe and read all of it into a buffer that is reused
+// between substitutions, returns the number of bytes captured or -1
+ssize_t CaptureOutput(char *p_cmd, char **dp_buf, size_t *p_bufSize)
+{
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC) != 0)
+        return -1;
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if(pid == 0)
+    {
+        ChildInit();
+        if(dup2(fds[1], STDOUT_FILENO) < 0)
+            ExitShell(1);
+        // the command text lives in a string arena the child resets for its own substitutions
+        char **dp_args = SplitLine(strdup(p_cmd), &g_lineTokens);
+        RunLineAndExit(dp_args, g_lineTokens.numTokens);
+    }
+    close(fds[1]);
+
+    size_t length = 0;
+    ssize_t bytes;
+    while(1)
+    {
+        if(*dp_buf == NULL || length == *p_bufSize)
+        {
+            *p_bufSize = (*p_bufSize == 0) ? LINE_BUFSIZE : 2 * *p_bufSize;
+            *dp_buf = realloc(*dp_buf, *p_bufSize);
+            if(*dp_buf == NULL)
+            {
+                PrintError();
+                exit(1);
+            }
+        }
+        bytes = read(fds[0], *dp_buf + length, *p_bufSize - length);
+        if(bytes < 0 && errno == EINTR)
+            continue;
+        if(bytes <= 0)
+            break;
+        length += bytes;
+    }
+    close(fds[0]);
+    WaitChild(pid, NULL);
+    return (bytes < 0) ? -1 : (ssize_t) length;
+}
+
+// words of a line before which command substitution is done now, the command of loop is substituted by
+// loop itself in every iteration (so $loop can be used inside $(...))
+int SubstitutionEnd(char **dp_args, int numArgs)
+{
+    int i = 0;
+    while(i < numArgs && (strcmp(dp_args[i], "time") == 0 || strcmp(dp_args[i], "pin") == 0
+                          || strcmp(dp_args[i], "nice") == 0))
+    {
+        if(strcmp(dp_args[i], "time") != 0)  // skip the CPU list or increment
+            i += (strcmp(dp_args[i], "nice") == 0 && i + 1 < numArgs && strcmp(dp_args[i + 1], "-n") == 0) ? 2 : 1;
+        i++;
+    }
+    if(i < numArgs && strcmp(dp_args[i], "loop") == 0)
+        return (i + 2 < numArgs) ? i + 2 : numArgs;
+    return numArgs;
+}
+
+// replace every $(...) in the first deferFrom arguments by the words of its output
+// words are built in a scratch buffer and copied into p_strings, returns 1 on an unterminated or failed substitution
+int ExpandArgs(TokenArena *p_out, StringArena *p_strings, char **dp_args, int numArgs, int deferFrom)
+{
+    static char *p_capture = NULL, *p_word = NULL;  // reused output and word buffers
+    static size_t captureSize = 0, wordSize = 0;
+
+    ResetTokens(p_out);
+    for(int i = 0; i < numArgs; i++)
+    {
+        char *p_arg = dp_args[i];
+        if(i >= deferFrom || strstr(p_arg, "$(") == NULL)
+        {
+            PushToken(p_out, p_arg);
+            continue;
+        }
+        size_t wordLength = 0;
+        int inWord = 0;  // a word has been started, even an empty one
+        while(*p_arg != '\0')
+        {
+            char *p_start = strstr(p_arg, "$(");
+            size_t literal = (p_start == NULL) ? strlen(p_arg) : (size_t) (p_start - p_arg);
+            char *p_text = p_arg;
+            ssize_t length = literal;
+            if(literal == 0)  // substitution, find the matching parenthesis
+            {
+                int depth = 1;
+                char *p_end = p_arg + 2;
+                for(; *p_end != '\0'; p_end++)
+                {
+                    if(p_end[0] == '$' && p_end[1] == '(')
+                    {
+                        depth++;
+                        p_end++;
+                    }
+                    else if(*p_end == ')' && --depth == 0)
+                        break;
+                }
+                if(depth != 0)  // unterminated
+                    return 1;
+                char *p_cmd = CopyString(p_strings, p_arg + 2, p_end - p_arg - 2);
+                if((length = CaptureOutput(p_cmd, &p_capture, &captureSize)) < 0)
+                    return 1;
+                while(length > 0 && p_capture[length - 1] == '\n')  // trailing newlines are dropped
+                    length--;
+                p_text = p_capture;
+                p_arg = p_end + 1;
+            }
+            else
+                p_arg += literal;
+
+            for(ssize_t j = 0; j < length; j++)
+            {
+                // output is split into words at whitespace, literal text is kept as it is
+                if(p_text != p_capture || !isspace((unsigned char) p_text[j]))
+                {
+                    if(wordLength + 1 > wordSize)
+                    {
+                        wordSize = (wordSize == 0) ? LINE_BUFSIZE : 2 * wordSize;
+                        p_word = realloc(p_word, wordSize);
+                        if(p_word == NULL)
+                        {
+                            PrintError();
+                            exit(1);
+                        }
+                    }
+                    p_word[wordLength++] = p_text[j];
+                    inWord = 1;
+                }
+                else if(inWord)
+                {
+                    PushToken(p_out, CopyString(p_strings, p_word, wordLength));
+                    wordLength = 0;
+                    inWord = 0;
+                }
+            }
+        }
+        if(inWord)
+            PushToken(p_out, CopyString(p_strings, (wordLength > 0) ? p_word : "", wordLength));
+    }
+    return 0;
+}
+
+// compiled batch scripts (batch mode and the source built-in)
+// a script is read and parsed once into a list of lines with pre-split arguments; the built-in number and
+// resolved path of a line are kept until cd, path or inproc change what its command resolves to, so running
+// a script again (source in a loop) costs no parsing and no PATH lookups
+typedef struct __CompiledLine {
+    char **dp_args;  // NULL terminated arguments without after: annotations and &, pointing into the script text
+    int numArgs;
+    int background;  // ended with &
+    int invalid;  // misplaced &, reported when the line runs
+    int substitute;  // has $(...), expanded (and resolved) every time it runs
+    int redirectionPos;  // position of >, -1 if none, -2 if misplaced
+    unsigned long resolveGen;  // g_resolveGen cmdNo and p_path were resolved in, 0 if not resolved
+    int cmdNo;  // IsBuiltInCommand() of the command
+    char *p_path;  // resolved executable of a non built-in command
+    long long parseStart, parseEnd;  // trace timestamps of parsing the line when it was compiled
+} CompiledLine;
+
+typedef struct __CompiledScript {
+    dev_t dev;  // cache key
+    ino_t ino;
+    struct timespec mtime;  // version of the file the lines were compiled from
+    off_t size;
+    char *p_text;  // script text, tokenized in place
+    CompiledLine *p_lines;
+    int numLines;
+    int depth;  // number of sources running it, a running script is not recompiled
+} CompiledScript;
+
+CompiledScript *gp_scripts = NULL;  // compiled script cache
+int g_numScripts = 0, g_scriptCapacity = 0;
+
+// run the command of a compiled line with its cached resolution
+int ExecuteCompiledCommand(CompiledLine *p_line)
+{
+    if(p_line->resolveGen != g_resolveGen)
+    {
+        p_line->cmdNo = IsBuiltInCommand(p_line->dp_args[0]);
+        free(p_line->p_path);
+        p_line->p_path = NULL;
+        char p_path[PATH_MAX];
+        if(p_line->cmdNo > 0)
+            p_line->resolveGen = g_resolveGen;
+        else if(CheckCommand(p_path, g_pathDir.dp_tokens, p_line->dp_args) == 0)  // a missing command is looked up again
+        {
+            p_line->p_path = strdup(p_path);
+            p_line->resolveGen = g_resolveGen;
+        }
+    }
+    if(p_line->cmdNo > 0)
+        return ExecuteBuiltInCommand(p_line->dp_args, p_line->cmdNo);
+    if(p_line->p_path == NULL || p_line->redirectionPos == -2)
+    {
+        PrintError();
+        return 1;
+    }
+    return RunExternalCommand(p_line->p_path, p_line->dp_args, p_line->numArgs, p_line->redirectionPos);
+}
+
+// run a line whose after: annotations and trailing & have been removed, p_compiled caches the resolution
+// of a compiled script line (NULL for an input line)
+int RunLine(char **dp_args, int numArgs, int background, CompiledLine *p_compiled)
+{
+    // command substitution, words of the current line live until the next line is executed
+    for(int i = 0; i < numArgs; i++)
+    {
+        if(strstr(dp_args[i], "$(") == NULL)
+            continue;
+        ResetStrings(&g_lineStrings);
+        if(ExpandArgs(&g_expandTokens, &g_lineStrings, dp_args, numArgs, SubstitutionEnd(dp_args, numArgs)) != 0
+           || g_expandTokens.numTokens == 0)
+        {
+            PrintError();
+            return 1;
+        }
+        dp_args = g_expandTokens.dp_tokens;
+        numArgs = g_expandTokens.numTokens;
+        p_compiled = NULL;
+        break;
+    }
+    if(background)
+        return ExecuteBackgroundCommand(dp_args, numArgs);
+    if(g_timeAll || g_timeSummary)
+        return TimeCommand(dp_args, numArgs, g_timeAll);
+    if(p_compiled != NULL)
+        return ExecuteCompiledCommand(p_compiled);
+    return ExecuteCommand(dp_args, numArgs);
+}
+
+// run one parsed input line, a trailing & makes it a background job
+int ExecuteLine(char **dp_args, int numArgs)
+{
+    int background = 0;
+    // after: annotations only matter to the parallel batch mode (-j)
+    while(numArgs > 0 && strncmp(dp_args[0], "after:", 6) == 0)
+    {
+        dp_args++;
+        numArgs--;
+    }
+    if(numArgs == 0)
+        return 0;
+    for(int i = 0; i < numArgs; i++)
+    {
+        if(strcmp(dp_args[i], "&") == 0)
+        {
+            // & is only allowed at the end of a command
+            if(i != numArgs - 1 || i == 0)
+            {
+                PrintError();
+                return 1;
+            }
+            dp_args[--numArgs] = NULL;
+            background = 1;
+        }
+    }
+    return RunLine(dp_args, numArgs, background, NULL);
+}
+
+// read a whole script into one NUL terminated buffer
+char *ReadScript(FILE *fp, size_t *p_size)
+{
+    char *p_script = NULL;
+    size_t scriptSize = 0, scriptCapacity = 0, bytes;
+    do
+    {
+        if(scriptSize + LINE_BUFSIZE + 1 > scriptCapacity)
+        {
+            scriptCapacity = (scriptCapacity == 0) ? 16 * LINE_BUFSIZE : 2 * scriptCapacity;
+            p_script = realloc(p_script, scriptCapacity);
+            if(p_script == NULL)
+            {
+                PrintError();
+                exit(1);
+            }
+        }
+        bytes = fread(p_script + scriptSize, 1, scriptCapacity - scriptSize - 1, fp);
+        scriptSize += bytes;
+    } while(bytes > 0);
+    p_script[scriptSize] = '\0';
+    *p_size = scriptSize;
+    return p_script;
+}
+
+// parse a script into its list of lines
+void CompileScript(CompiledScript *p_script, FILE *fp)
+{
+    size_t scriptSize;
+    p_script->p_text = ReadScript(fp, &scriptSize);
+    int numFileLines = 1;
+    for(size_t i = 0; i < scriptSize; i++)
+        numFileLines += (p_script->p_text[i] == '\n');
+    p_script->p_lines = calloc(numFileLines, sizeof(CompiledLine));
+    p_script->numLines = 0;
+
+    char *p_next = p_script->p_text;
+    for(int lineNo = 0; lineNo < numFileLines; lineNo++)
+    {
+        char *p_text = p_next;
+        p_next = strchr(p_text, '\n');
+        if(p_next != NULL)
+            *p_next++ = '\0';
+        else
+            p_next = p_text + strlen(p_text);
+        long long parseStart = TraceNow();
+        p_text = TrimWhiteSpace(p_text);
+        if(*p_text == '\0')
+            continue;
+
+        SplitLine(p_text, &g_lineTokens);
+        char **dp_args = g_lineTokens.dp_tokens;
+        int numArgs = g_lineTokens.numTokens;
+        while(numArgs > 0 && strncmp(dp_args[0], "after:", 6) == 0)
+        {
+            dp_args++;
+            numArgs--;
+        }
+        if(numArgs == 0)  // only annotations
+            continue;
+        CompiledLine *p_line = &p_script->p_lines[p_script->numLines++];
+        p_line->parseStart = parseStart;
+        p_line->redirectionPos = -1;
+        for(int i = 0; i < numArgs; i++)
+        {
+            if(strcmp(dp_args[i], "&") != 0)
+                continue;
+            if(i != numArgs - 1 || i == 0)  // & is only allowed at the end of a command
+                p_line->invalid = 1;
+            else
+            {
+                numArgs--;
+                p_line->background = 1;
+            }
+        }
+        for(int i = 0; i < numArgs; i++)
+        {
+            if(strcmp(dp_args[i], ">") == 0 && p_line->redirectionPos == -1)
+                p_line->redirectionPos = (i == numArgs - 2) ? i : -2;
+            p_line->substitute |= (strstr(dp_args[i], "$(") != NULL);
+        }
+        // keep an exact-size copy of the token array, the token arena is reused for the next line
+        p_line->numArgs = numArgs;
+        p_line->dp_args = malloc((numArgs + 1) * sizeof(char*));
+        if(p_line->dp_args == NULL)
+        {
+            PrintError();
+            exit(1);
+        }
+        memcpy(p_line->dp_args, dp_args, numArgs * sizeof(char*));
+        p_line->dp_args[numArgs] = NULL;
+        p_line->parseEnd = TraceNow();
+    }
+}
+
+void FreeCompiledScript(CompiledScript *p_script)
+{
+    for(int i = 0; i < p_script->numLines; i++)
+    {
+        free(p_script->p_lines[i].dp_args);
+        free(p_script->p_lines[i].p_path);
+    }
+    free(p_script->p_lines);
+    free(p_script->p_text);
+}
+
+// compiled version of a script, compiled (again) if it is not cached or the file has changed since
+CompiledScript *LoadScript(char *p_file)
+{
+    FILE *fp = fopen(p_file, "r");
+    struct stat st;
+    if(fp == NULL || fstat(fileno(fp), &st) != 0)
+    {
+        if(fp != NULL)
+            fclose(fp);
+        return NULL;
+    }
+    CompiledScript *p_script = NULL;
+    for(int i = 0; i < g_numScripts && p_script == NULL; i++)
+        if(gp_scripts[i].dev == st.st_dev && gp_scripts[i].ino == st.st_ino)
+            p_script = &gp_scripts[i];
+    if(p_script != NULL && (p_script->depth > 0 || (p_script->size == st.st_size
+       && p_script->mtime.tv_sec == st.st_mtim.tv_sec && p_script->mtime.tv_nsec == st.st_mtim.tv_nsec)))
+    {
+        fclose(fp);
+        return p_script;
+    }
+    if(p_script != NULL)  // changed since it was compiled
+        FreeCompiledScript(p_script);
+    else
+    {
+        if(g_numScripts == g_scriptCapacity)
+        {
+            g_scriptCapacity = (g_scriptCapacity == 0) ? 8 : 2 * g_scriptCapacity;
+            gp_scripts = realloc(gp_scripts, g_scriptCapacity * sizeof(CompiledScript));
+            if(gp_scripts == NULL)
+            {
+                PrintError();
+                exit(1);
+            }
+        }
+        p_script = &gp_scripts[g_numScripts++];
+    }
+    memset(p_script, 0, sizeof(CompiledScript));
+    p_script->dev = st.st_dev;
+    p_script->ino = st.st_ino;
+    p_script->mtime = st.st_mtim;
+    p_script->size = st.st_size;
+    CompileScript(p_script, fp);
+    fclose(fp);
+    return p_script;
+}
+
+void FreeArenas(TokenArena *p_tokens, int numTokenArenas, StringArena *p_strings, int numStringArenas)
+{
+    for(int i = 0; i < numTokenArenas; i++)
+        free(p_tokens[i].dp_tokens);
+    for(int i = 0; i < numStringArenas; i++)
+    {
+        for(StringBlock *p_block = p_strings[i].p_head, *p_next; p_block != NULL; p_block = p_next)
+        {
+            p_next = p_block->p_next;
+            free(p_block);
+        }
+    }
+}
+
+// run every line of a compiled script, returns the status of the last one
+int SourceScript(char *p_file)
+{
+    CompiledScript *p_script = LoadScript(p_file);
+    if(p_script == NULL)
+    {
+        PrintError();
+        return 1;
+    }
+    // the lines of the script get their own expansion arenas, the line (or loop iteration) that
+    // sourced it keeps its arguments
+    TokenArena p_savedTokens[3] = {g_expandTokens, g_loopTokens, g_loopExpandTokens};
+    StringArena p_savedStrings[2] = {g_lineStrings, g_loopStrings};
+    memset(&g_expandTokens, 0, sizeof(TokenArena));
+    memset(&g_loopTokens, 0, sizeof(TokenArena));
+    memset(&g_loopExpandTokens, 0, sizeof(TokenArena));
+    memset(&g_lineStrings, 0, sizeof(StringArena));
+    memset(&g_loopStrings, 0, sizeof(StringArena));
+
+    // the cache may move when another script is compiled, lines are found again by index
+    int index = p_script - gp_scripts, status = 0;
+    gp_scripts[index].depth++;
+    for(int i = 0; i < gp_scripts[index].numLines; i++)
+    {
+        CompiledLine *p_line = &gp_scripts[index].p_lines[i];
+        if(!g_interactive)
+            ReportJobs();
+        memset(&g_trace, 0, sizeof(g_trace));
+        // parsed when the script was compiled, running it again from the cache parses nothing
+        g_trace.parseStart = p_line->parseStart;
+        g_trace.parseEnd = p_line->parseEnd;
+        p_line->parseStart = p_line->parseEnd = 0;
+        if(p_line->invalid)
+        {
+            PrintError();
+            status = 1;
+            continue;
+        }
+        status = RunLine(p_line->dp_args, p_line->numArgs, p_line->background, p_line);
+    }
+    gp_scripts[index].depth--;
+
+    TokenArena p_scriptTokens[3] = {g_expandTokens, g_loopTokens, g_loopExpandTokens};
+    StringArena p_scriptStrings[2] = {g_lineStrings, g_loopStrings};
+    FreeArenas(p_scriptTokens, 3, p_scriptStrings, 2);
+    g_expandTokens = p_savedTokens[0];
+    g_loopTokens = p_savedTokens[1];
+    g_loopExpandTokens = p_savedTokens[2];
+    g_lineStrings = p_savedStrings[0];
+    g_loopStrings = p_savedStrings[1];
+    return status;
+}
+
+// parallel batch mode (-j N)
+// the whole batch file is parsed up front into a dependency graph of lines:
+//   - a line depends on the last line writing any of its arguments (read after write)
+//   - a write waits for the last line writing and every line reading the file since (write after read/write)
+//   - a redirection (>) writes its target and reads the other arguments, a line without redirection
+//     (cp, rm, mkdir, gcc -o ...) is assumed to write every argument; options (-x) are not files
+//   - after:<line>[,<line>...] annotations add dependencies on the given (earlier) batch file lines
+//   - built-ins that change shell state (exit, cd, path, jobs, wait, inproc, source), also behind the time, pin,
+//     nice and loop prefixes, are barriers run by the shell itself
+// independent lines then run concurrently, each one in its own worker process
+typedef struct __IntList {
+    int *p_items;
+    int count;
+    int capacity;
+} IntList;
+
+typedef struct __ScriptLine {
+    char **dp_args;  // NULL terminated arguments, pointing into the script buffer
+    int numArgs;
+    int barrier;  // runs in the shell itself, after every earlier line and before every later one
+    int numPending;  // dependencies that have not finished yet
+    IntList successors;  // lines depending on this one
+    pid_t pid;  // worker running the line
+    struct timespec start;  // when the worker was started (-S)
+} ScriptLine;
+
+// file name -> lines using it, used to infer dependencies
+typedef struct __FileUse {
+    char *p_name;  // NULL for an empty hash table slot
+    int lastWriter;  // line redirecting into the file last, -1 if none
+    IntList readers;  // lines reading the file since the last write
+} FileUse;
+
+// a line changes shell state if its command, behind the time, pin, nice and loop prefixes, is a built-in other
+// than those prefixes; in a worker process its effect would be lost
+int IsBarrierLine(char **dp_args, int numArgs)
+{
+    int i = 0;
+    while(i < numArgs)
+    {
+        int builtInCmdNo = IsBuiltInCommand(dp_args[i]);
+        if(builtInCmdNo == 5)  // time
+            i++;
+        else if(builtInCmdNo == 9)  // pin <cpulist>
+            i += 2;
+        else if(builtInCmdNo == 10 || builtInCmdNo == 4)  // nice [-n] <increment>, loop [-p] <count>
+            i += (i + 1 < numArgs && (strcmp(dp_args[i + 1], "-n") == 0 || strcmp(dp_args[i + 1], "-p") == 0)) ? 3 : 2;
+        else
+            return builtInCmdNo >= 1 && builtInCmdNo <= NUM_BUILTIN_CMDS;
+    }
+    return 0;
+}
+
+void PushInt(IntList *p_list, int item)
+{
+    if(p_list->count == p_list->capacity)
+    {
+        p_list->capacity = (p_list->capacity == 0) ? 4 : 2 * p_list->capacity;
+        p_list->p_items = realloc(p_list->p_items, p_list->capacity * sizeof(int));
+        if(p_list->p_items == NULL)
+        {
+            PrintError();
+            exit(1);
+        }
+    }
+    p_list->p_items[p_list->count++] = item;
+}
+
+void AddDependency(ScriptLine *p_lines, int from, int to)
+{
+    if(from < 0 || from == to)
+        return;
+    PushInt(&p_lines[from].successors, to);
+    p_lines[to].numPending++;
+}
+
+unsigned long HashString(char *str)
+{
+    unsigned long hash = 5381;  // djb2
+    while(*str != '\0')
+        hash = hash * 33 + (unsigned char) *str++;
+    return hash;
+}
+
+// find (or insert) the usage record of a file in an open addressing hash table of *p_capacity slots
+FileUse *LookupFile(FileUse **dp_table, int *p_capacity, int *p_count, char *p_name)
+{
+    if(2 * (*p_count + 1) > *p_capacity)  // keep the load factor under 1/2
+    {
+        int oldCapacity = *p_capacity;
+        FileUse *p_old = *dp_table;
+        *p_capacity = (oldCapacity == 0) ? 64 : 2 * oldCapacity;
+        *dp_table = calloc(*p_capacity, sizeof(FileUse));
+        if(*dp_table == NULL)
+        {
+            PrintError();
+            exit(1);
+        }
+        for(int i = 0; i < oldCapacity; i++)
+        {
+            if(p_old[i].p_name == NULL)
+                continue;
+            unsigned long slot = HashString(p_old[i].p_name) & (*p_capacity - 1);
+            while((*dp_table)[slot].p_name != NULL)
+                slot = (slot + 1) & (*p_capacity - 1);
+            (*dp_table)[slot] = p_old[i];
+        }
+        free(p_old);
+    }
+    unsigned long slot = HashString(p_name) & (*p_capacity - 1);
+    while((*dp_table)[slot].p_name != NULL && strcmp((*dp_table)[slot].p_name, p_name) != 0)
+        slot = (slot + 1) & (*p_capacity - 1);
+    FileUse *p_use = &(*dp_table)[slot];
+    if(p_use->p_name == NULL)
+    {
+        p_use->p_name = p_name;
+        p_use->lastWriter = -1;
+        (*p_count)++;
+    }
+    return p_use;
+}
+
+// start a line in a worker process, returns the worker's pid
+pid_t StartWorker(ScriptLine *p_line)
+{
+    pid_t pid = fork();
+    if(pid < 0)
+    {
+        PrintError();
+        exit(1);
+    }
+    if(pid > 0)
+        return pid;
+
+    // worker
+    ChildInit();
+    char **dp_args = p_line->dp_args;
+    int numArgs = p_line->numArgs;
+    if(strcmp(dp_args[numArgs - 1], "&") == 0)  // the line already runs concurrently
+        dp_args[--numArgs] = NULL;
+    g_timeSummary = 0;  // the shell accounts for the whole worker
+    RunLineAndExit(dp_args, numArgs);
+    return -1;
+}
+
+int RunScriptParallel(FILE *fp, int numWorkers)
+{
+    // read the whole batch file, lines are tokenized in place
+    size_t scriptSize;
+    char *p_script = ReadScript(fp, &scriptSize);
+    fclose(fp);
+
+    int numFileLines = 1;
+    for(size_t i = 0; i < scriptSize; i++)
+        numFileLines += (p_script[i] == '\n');
+    ScriptLine *p_lines = calloc(numFileLines, sizeof(ScriptLine));
+    int *p_lineIndex = malloc(numFileLines * sizeof(int));  // batch file line number - 1 -> line, -1 if blank
+    FileUse *p_files = NULL;
+    int filesCapacity = 0, numFiles = 0;
+    int numLines = 0, lastBarrier = -1;
+
+    char *p_next = p_script;
+    for(int lineNo = 0; lineNo < numFileLines; lineNo++)
+    {
+        char *p_text = p_next;
+        p_next = strchr(p_text, '\n');
+        if(p_next != NULL)
+            *p_next++ = '\0';
+        else
+            p_next = p_text + strlen(p_text);
+        p_lineIndex[lineNo] = -1;
+        p_text = TrimWhiteSpace(p_text);
+        if(*p_text == '\0')
+            continue;
+
+        // keep an exact-size copy of the token array, the token arena is reused for the next line
+        SplitLine(p_text, &g_lineTokens);
+        int first = 0;
+        while(first < g_lineTokens.numTokens && strncmp(g_lineTokens.dp_tokens[first], "after:", 6) == 0)
+            first++;
+        if(first == g_lineTokens.numTokens)  // only annotations
+            continue;
+        int index = numLines++;
+        ScriptLine *p_line = &p_lines[index];
+        p_lineIndex[lineNo] = index;
+        p_line->numArgs = g_lineTokens.numTokens - first;
+        p_line->dp_args = malloc((p_line->numArgs + 1) * sizeof(char*));
+        memcpy(p_line->dp_args, g_lineTokens.dp_tokens + first, (p_line->numArgs + 1) * sizeof(char*));
+
+        p_line->barrier = IsBarrierLine(p_line->dp_args, p_line->numArgs);
+        if(p_line->barrier)
+        {
+            for(int i = (lastBarrier < 0) ? 0 : lastBarrier; i < index; i++)
+                AddDependency(p_lines, i, index);
+            lastBarrier = index;
+            continue;
+        }
+        AddDependency(p_lines, lastBarrier, index);
+
+        // explicit dependencies
+        for(int i = 0; i < first; i++)
+        {
+            char *p_dep = g_lineTokens.dp_tokens[i] + 6;
+            while(*p_dep != '\0')
+            {
+                char *p_end;
+                long depLine = strtol(p_dep, &p_end, 10);
+                if(p_end == p_dep || depLine <= 0 || depLine > lineNo)  // not an earlier line, depend on everything
+                {
+                    PrintError();
+                    for(int j = 0; j < index; j++)
+                        AddDependency(p_lines, j, index);
+                    break;
+                }
+                AddDependency(p_lines, p_lineIndex[depLine - 1], index);
+                p_dep = (*p_end == ',') ? p_end + 1 : p_end;
+            }
+        }
+
+        // inferred dependencies, the command name itself is not a file
+        int redirected = 0;
+        for(int i = 1; i < p_line->numArgs; i++)
+            redirected |= (strcmp(p_line->dp_args[i], ">") == 0);
+        for(int i = 1; i < p_line->numArgs; i++)
+        {
+            char *p_arg = p_line->dp_args[i];
+            if(strcmp(p_arg, ">") == 0 || strcmp(p_arg, "&") == 0 || p_arg[0] == '-')
+                continue;
+            FileUse *p_use = LookupFile(&p_files, &filesCapacity, &numFiles, p_arg);
+            if(!redirected || strcmp(p_line->dp_args[i - 1], ">") == 0)  // written
+            {
+                AddDependency(p_lines, p_use->lastWriter, index);
+                for(int j = 0; j < p_use->readers.count; j++)
+                    AddDependency(p_lines, p_use->readers.p_items[j], index);
+                p_use->lastWriter = index;
+                p_use->readers.count = 0;
+            }
+            else  // argument, read
+            {
+                AddDependency(p_lines, p_use->lastWriter, index);
+                PushInt(&p_use->readers, index);
+            }
+        }
+    }
+
+    // schedule, lines whose dependencies have all finished are ready to run
+    int *p_ready = malloc((numLines + 1) * sizeof(int));  // FIFO of ready lines, every line enters it once
+    int readyHead = 0, readyTail = 0, running = 0, finished = 0;
+    for(int i = 0; i < numLines; i++)
+        if(p_lines[i].numPending == 0)
+            p_ready[readyTail++] = i;
+
+    while(finished < numLines)
+    {
+        // start ready lines while there are idle workers, a barrier runs once nothing else is running
+        while(readyHead < readyTail && running < numWorkers)
+        {
+            ScriptLine *p_line = &p_lines[p_ready[readyHead]];
+            if(p_line->barrier)
+            {
+                if(running > 0)
+                    break;
+                readyHead++;
+                ExecuteLine(p_line->dp_args, p_line->numArgs);
+                p_line->pid = 0;
+                finished++;
+                for(int i = 0; i < p_line->successors.count; i++)
+                    if(--p_lines[p_line->successors.p_items[i]].numPending == 0)
+                        p_ready[readyTail++] = p_line->successors.p_items[i];
+                continue;
+            }
+            readyHead++;
+            clock_gettime(CLOCK_MONOTONIC, &p_line->start);
+            p_line->pid = StartWorker(p_line);
+            running++;
+        }
+        if(running == 0)  // nothing ready either: every line has finished, dependencies only point backwards
+        {
+            if(finished < numLines)
+            {
+                PrintError();
+                exit(1);
+            }
+            continue;
+        }
+
+        // wait for any worker to finish and release the lines depending on it
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if(pid < 0)
+        {
+            PrintError();
+            exit(1);
+        }
+        for(int i = 0; i < numLines; i++)
+        {
+            ScriptLine *p_line = &p_lines[i];
+            if(p_line->pid != pid)
+                continue;
+            p_line->pid = 0;
+            running--;
+            finished++;
+            if(g_timeSummary)
+            {
+                struct timespec end;
+                clock_gettime(CLOCK_MONOTONIC, &end);
+                AddTimeEntry(p_line->dp_args[0],
+                             (end.tv_sec - p_line->start.tv_sec) + (end.tv_nsec - p_line->start.tv_nsec) / 1e9,
+                             Seconds(usage.ru_utime), Seconds(usage.ru_stime), usage.ru_maxrss, usage.ru_nvcsw,
+                             usage.ru_nivcsw);
+            }
+            for(int j = 0; j < p_line->successors.count; j++)
+                if(--p_lines[p_line->successors.p_items[j]].numPending == 0)
+                    p_ready[readyTail++] = p_line->successors.p_items[j];
+            break;
+        }
+    }
+    return 0;
+}
+
+// interactive mode: wait for input on a terminal, reaping background jobs as soon as they finish
+void WaitForInput()
+{
+    struct pollfd fds[2];
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = POLLIN;
+    fds[1].fd = g_sigFd;
+    fds[1].events = POLLIN;
+    while(g_numJobs > 0 && poll(fds, 2, -1) > 0)
+    {
+        if(fds[1].revents & POLLIN)
+            ReapJobs();
+        if(fds[0].revents != 0)
+            return;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    opterr = 0;  // unknown options are reported with the shell's own error message
+    int numWorkers = 0;  // -j: run a batch file as a dependency graph on this many workers
+    char *p_traceFile = getenv("WISH_TRACE");  // tracing to this file, -x alone traces to STDERR
+    int trace = (p_traceFile != NULL && *p_traceFile != '\0');
+    int zygote = 0;  // -z: foreground commands are forked by a helper started now
+    while((opt = getopt(argc, argv, "TSj:xz")) != -1)
+    {
+        switch(opt)
+        {
+            case 'z':  // fork server
+                zygote = 1;
+                break;
+            case 'x':  // command launch tracing
+                trace = 1;
+                break;
+            case 'j':  // parallel batch mode
+                numWorkers = atoi(optarg);
+                if(numWorkers <= 0)
+                {
+                    PrintError();
+                    exit(1);
+                }
+                break;
+            case 'T':  // report resource usage of every command
+                g_timeAll = 1;
+                break;
+            case 'S':  // summary table at the end of a batch file
+                g_timeSummary = 1;
+                break;
+            default:
+                PrintError();
+                exit(1);
+        }
+    }
+    if(argc - optind > 1) // shell invoked with more than one file
+    {
+        PrintError();
+        exit(1);
+    }
+    int batchMode = (argc - optind == 1);
+    FILE *fp = stdin;
+
+    if(batchMode)  // batch mode
+    {
+        if((fp = fopen(argv[optind], "r")) == NULL)  //batch file does not exist
+        {
+            PrintError();
+            exit(1);
+        }
+    }
+    if(trace)
+    {
+        if(p_traceFile == NULL || *p_traceFile == '\0')
+            g_traceFd = STDERR_FILENO;
+        else if((g_traceFd = open(p_traceFile, O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, 0644)) < 0)
+        {
+            PrintError();
+            exit(1);
+        }
+    }
+    g_interactive = !batchMode;
+    // on a terminal stdin is read unbuffered, so polling it tells whether a line is pending
+    int pollInput = g_interactive && isatty(STDIN_FILENO);
+    if(pollInput)
+        setvbuf(stdin, NULL, _IONBF, 0);
+
+    // SIGCHLD is delivered through a signalfd, background jobs are reaped without blocking the shell
+    sigset_t sigChld;
+    sigemptyset(&sigChld);
+    sigaddset(&sigChld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigChld, &g_origSigMask);
+    g_sigFd = signalfd(-1, &sigChld, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    char *p_lineBuf = NULL, *p_inputLine, **dp_args;  // p_lineBuf is the one line buffer reused for every input line
+    size_t lineBufSize = 0;
+
+    // initial default contents of path directory
+    PushToken(&g_pathDir, strdup("/bin"));
+    if(zygote)
+        StartZygote();
+
+    if(batchMode && numWorkers > 0)
+    {
+        RunScriptParallel(fp, numWorkers);
+        ExitShell(0);
+    }
+    while(1)
+    {
+        ReportJobs();
+        if(!batchMode)  // interactive mode
+        {
+            // print prompt message by writing into stdin
+            printf("wish> ");
+            fflush(stdout);
+            if(pollInput)
+                WaitForInput();
+        }
+        if(ReadLine(fp, &p_lineBuf, &lineBufSize) == -1)  // end of input
+        {
+            if(fp != stdin)
+                fclose(fp);
+            ExitShell(0);
+        }
+
+        memset(&g_trace, 0, sizeof(g_trace));
+        g_trace.parseStart = TraceNow();
+        p_inputLine = TrimWhiteSpace(p_lineBuf); // remove leading and trailing whitespaces
+        // handling case where no command is written or input is all whitespaces
+        if(*p_inputLine == '\0')
+            continue;
+
+        // parse input line for arguments
+        dp_args = SplitLine(p_inputLine, &g_lineTokens);
+        g_trace.parseEnd = TraceNow();
+        ExecuteLine(dp_args, g_lineTokens.numTokens);
     }
 }
@@ -0,0 +1,158 @@
+#include <stdio.h>  // IO operations
+#include <stdlib.h>  // memory allocations, qsort
+#include <string.h>  // string operations
+
+// summarizes the JSON lines written by wish -x (or WISH_TRACE=<file>)
+// usage: wishtrace [trace file ...], reads STDIN without arguments
+// prints latency percentiles of every launch phase and how launch time splits between spawning and running
+
+#define LINE_BUFSIZE 1024  // initial number of bytes reserved for a trace record
+#define NUM_PHASES 6
+
+// launch phases, computed from the timestamps of a record
+enum { PARSE, RESOLVE, FORK, EXEC, RUN, TOTAL };
+char *gp_phaseNames[NUM_PHASES] = {"parse", "resolve", "fork", "exec", "run", "total"};
+
+// latencies (ns) of one phase over every record
+typedef struct __Samples {
+    long long *p_values;
+    long count;
+    long capacity;
+} Samples;
+
+Samples g_phases[NUM_PHASES];
+long g_numExec = 0, g_numInProc = 0, g_numUnresolved = 0;  // records per kind
+
+void AddSample(Samples *p_samples, long long value)
+{
+    if(p_samples->count == p_samples->capacity)
+    {
+        p_samples->capacity = (p_samples->capacity == 0) ? 1024 : 2 * p_samples->capacity;
+        p_samples->p_values = realloc(p_samples->p_values, p_samples->capacity * sizeof(long long));
+        if(p_samples->p_values == NULL)
+        {
+            fprintf(stderr, "wishtrace: out of memory\n");
+            exit(1);
+        }
+    }
+    p_samples->p_values[p_samples->count++] = value;
+}
+
+// value of "key":<integer> in a record, 0 if missing
+long long GetField(char *p_line, char *p_key)
+{
+    char p_pattern[64];
+    snprintf(p_pattern, sizeof(p_pattern), "\"%s\":", p_key);
+    char *p_field = strstr(p_line, p_pattern);
+    return (p_field == NULL) ? 0 : strtoll(p_field + strlen(p_pattern), NULL, 10);
+}
+
+// add the phase latencies of one record, phases whose timestamps are 0 did not happen
+void AddRecord(char *p_line)
+{
+    long long parseStart = GetField(p_line, "parse_start"), parseEnd = GetField(p_line, "parse_end");
+    long long resolveStart = GetField(p_line, "resolve_start"), resolveEnd = GetField(p_line, "resolve_end");
+    long long forkStart = GetField(p_line, "fork_start"), forkEnd = GetField(p_line, "fork_end");
+    long long execEnd = GetField(p_line, "exec_end"), exitTime = GetField(p_line, "exit");
+    if(exitTime == 0)  // not a trace record
+        return;
+
+    if(parseStart != 0 && parseEnd != 0)
+        AddSample(&g_phases[PARSE], parseEnd - parseStart);
+    if(resolveStart != 0 && resolveEnd != 0)
+        AddSample(&g_phases[RESOLVE], resolveEnd - resolveStart);
+    if(strstr(p_line, "\"kind\":\"exec\"") != NULL)
+    {
+        g_numExec++;
+        if(forkStart != 0 && forkEnd != 0)
+            AddSample(&g_phases[FORK], forkEnd - forkStart);
+        if(forkEnd != 0 && execEnd != 0)
+            AddSample(&g_phases[EXEC], execEnd - forkEnd);
+        if(execEnd != 0)
+            AddSample(&g_phases[RUN], exitTime - execEnd);
+    }
+    else if(strstr(p_line, "\"kind\":\"unresolved\"") != NULL)  // not found in PATH, never launched
+        g_numUnresolved++;
+    else  // in-process command, it runs right after being resolved
+    {
+        g_numInProc++;
+        if(resolveEnd != 0)
+            AddSample(&g_phases[RUN], exitTime - resolveEnd);
+    }
+    long long start = (parseStart != 0) ? parseStart : (resolveStart != 0) ? resolveStart : forkStart;
+    if(start != 0)
+        AddSample(&g_phases[TOTAL], exitTime - start);
+}
+
+int CompareValues(const void *p_a, const void *p_b)
+{
+    long long a = *(const long long *) p_a, b = *(const long long *) p_b;
+    return (a > b) - (a < b);
+}
+
+// nearest-rank percentile of sorted samples
+long long Percentile(Samples *p_samples, double percent)
+{
+    long rank = (long) (percent / 100.0 * p_samples->count + 0.999999);
+    if(rank < 1)
+        rank = 1;
+    return p_samples->p_values[rank - 1];
+}
+
+long long Sum(Samples *p_samples)
+{
+    long long sum = 0;
+    for(long i = 0; i < p_samples->count; i++)
+        sum += p_samples->p_values[i];
+    return sum;
+}
+
+void ReadTrace(FILE *fp)
+{
+    char *p_line = NULL;
+    size_t bufSize = 0;
+    while(getline(&p_line, &bufSize, fp) != -1)
+        AddRecord(p_line);
+    free(p_line);
+}
+
+int main(int argc, char **argv)
+{
+    if(argc == 1)
+        ReadTrace(stdin);
+    for(int i = 1; i < argc; i++)
+    {
+        FILE *fp = fopen(argv[i], "r");
+        if(fp == NULL)
+        {
+            fprintf(stderr, "wishtrace: cannot open %s\n", argv[i]);
+            exit(1);
+        }
+        ReadTrace(fp);
+        fclose(fp);
+    }
+
+    printf("commands: %ld (exec %ld, in-process %ld, unresolved %ld)\n", g_numExec + g_numInProc + g_numUnresolved,
+           g_numExec, g_numInProc, g_numUnresolved);
+    printf("%-8s %10s %12s %12s %12s %12s %12s\n", "phase", "count", "mean_us", "p50_us", "p90_us", "p99_us",
+           "max_us");
+    for(int i = 0; i < NUM_PHASES; i++)
+    {
+        Samples *p_samples = &g_phases[i];
+        if(p_samples->count == 0)
+            continue;
+        qsort(p_samples->p_values, p_samples->count, sizeof(long long), CompareValues);
+        printf("%-8s %10ld %12.1f %12.1f %12.1f %12.1f %12.1f\n", gp_phaseNames[i], p_samples->count,
+               Sum(p_samples) / 1e3 / p_samples->count, Percentile(p_samples, 50) / 1e3,
+               Percentile(p_samples, 90) / 1e3, Percentile(p_samples, 99) / 1e3,
+               p_samples->p_values[p_samples->count - 1] / 1e3);
+    }
+
+    // spawn-bound or work-bound: time spent getting commands running versus running them
+    long long spawn = Sum(&g_phases[PARSE]) + Sum(&g_phases[RESOLVE]) + Sum(&g_phases[FORK]) + Sum(&g_phases[EXEC]);
+    long long work = Sum(&g_phases[RUN]);
+    if(spawn + work > 0)
+        printf("spawn %.1f%% / work %.1f%% of launch time: %s-bound\n", 100.0 * spawn / (spawn + work),
+               100.0 * work / (spawn + work), (spawn > work) ? "spawn" : "work");
+    return 0;
+}
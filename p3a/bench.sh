@@ -0,0 +1,99 @@
+#!/bin/bash
+# pzip benchmark suite: compresses every corpus over a sweep of codecs, thread counts and chunk sizes and prints one
+# CSV line per configuration (the fastest of BENCH_REPEAT runs), so results can be diffed to track regressions
+# usage: ./bench.sh [corpus_dir] > bench.csv, or make bench
+# corpora are generated into corpus_dir (/tmp/pzip-bench by default) unless they are already there, so the same files
+# are reused across runs and any of them can be replaced by your own data:
+#   same     BENCH_MB MiB of one repeated byte
+#   random   BENCH_MB MiB of random bytes
+#   text     BENCH_MB MiB of words and spaces
+#   mixed    BENCH_MB MiB of runs of random lengths (1 to 2000) of random letters
+#   small/   1000 small files (f000 .. f999) cut from text, compressed together
+# environment (defaults in parentheses):
+#   BENCH_MB       size of each generated corpus (64)
+#   BENCH_THREADS  compressor thread counts, -t ("1 2 4" and the number of cores)
+#   BENCH_CHUNKS   chunk sizes, -b, "auto" lets pzip choose ("auto 256K 4M 32M")
+#   BENCH_CODECS   codecs, -c ("units varint")
+#   BENCH_REPEAT   runs per configuration (3)
+# columns: wall_ms and mb_per_s are measured around the whole process; maxrss_kb, peak_buffers and the stage times
+# (read_ms, compress_ms summed over the compressor threads, write_ms) come from pzip -v
+
+DIR=${1:-/tmp/pzip-bench}
+PZIP=$(cd "$(dirname "$0")" && pwd)/pzip
+MB=${BENCH_MB:-64}
+THREADS=${BENCH_THREADS:-$(printf "1\n2\n4\n%s\n" "$(nproc)" | sort -nu | tr '\n' ' ')}
+CHUNKS=${BENCH_CHUNKS:-auto 256K 4M 32M}
+CODECS=${BENCH_CODECS:-units varint}
+REPEAT=${BENCH_REPEAT:-3}
+
+mkdir -p "$DIR" || exit 1
+cd "$DIR" || exit 1
+
+# 1 MiB generated by awk (seeded, so corpora are the same on every machine), repeated to the corpus size
+repeat_block () {
+    awk -v seed="$1" -v kind="$2" 'BEGIN {
+        srand (seed); n = 0; split ("the quick brown fox jumps over lazy dog zzzzzzzz aaaa", words, " ")
+        while (n < 1048576) {
+            if (kind == "text") {
+                s = words[int (rand () * 11) + 1] ((rand () < 0.1) ? "\n" : " ")
+            } else {
+                len = int (rand () * 2000) + 1; c = sprintf ("%c", 97 + int (rand () * 26))
+                s = sprintf ("%" len "s", ""); gsub (/ /, c, s)
+            }
+            printf "%s", s; n += length (s)
+        }
+    }' | head -c 1048576 > block.tmp
+    for ((i = 0; i < MB; i++)); do cat block.tmp; done
+    rm -f block.tmp
+}
+
+[ -f same ] || head -c $((MB * 1048576)) /dev/zero | tr '\0' 'q' > same
+[ -f random ] || head -c $((MB * 1048576)) /dev/urandom > random
+[ -f text ] || repeat_block 1 text > text
+[ -f mixed ] || repeat_block 2 mixed > mixed
+if [ ! -f small/f999 ]; then
+    mkdir -p small && split -d -a 3 -n 1000 text small/f
+fi
+
+# value of key=value in the pzip -v report
+field () {
+    sed -n "s/.* $1=\([^ ]*\).*/\1/p" stats.tmp
+}
+
+echo "corpus,input_bytes,codec,threads,chunk_size,output_mode,output_bytes,ratio,wall_ms,mb_per_s,maxrss_kb,peak_buffers,read_ms,compress_ms,write_ms"
+for corpus in same random text mixed small; do
+    if [ "$corpus" = small ]; then
+        inputs=(small/*)
+    else
+        inputs=("$corpus")
+    fi
+    input_bytes=$(cat "${inputs[@]}" | wc -c)
+    for codec in $CODECS; do
+        for threads in $THREADS; do
+            for chunk in $CHUNKS; do
+                opts=(-v -c "$codec" -t "$threads")
+                [ "$chunk" != auto ] && opts+=(-b "$chunk")
+                best=
+                for ((r = 0; r < REPEAT; r++)); do
+                    start=$(date +%s%N)
+                    "$PZIP" "${opts[@]}" "${inputs[@]}" > out.tmp 2> run.tmp || { cat run.tmp >&2; exit 1; }
+                    ns=$(( $(date +%s%N) - start ))
+                    if [ -z "$best" ] || [ "$ns" -lt "$best" ]; then
+                        best=$ns
+                        mv run.tmp stats.tmp
+                    fi
+                done
+                output_bytes=$(wc -c < out.tmp)
+                awk -v corpus="$corpus" -v in_bytes="$input_bytes" -v codec="$codec" -v threads="$threads" \
+                    -v chunk="$(field chunk_size)" -v mode="$(field output)" -v out_bytes="$output_bytes" -v ns="$best" \
+                    -v rss="$(field maxrss_kb)" -v peak="$(field peak_buffers)" -v rd="$(field read_ms)" \
+                    -v cmp="$(field compress_ms)" -v wr="$(field write_ms)" 'BEGIN {
+                    printf "%s,%d,%s,%d,%d,%s,%d,%.4f,%.1f,%.1f,%d,%d,%s,%s,%s\n", corpus, in_bytes, codec, threads,
+                           chunk, mode, out_bytes, out_bytes / in_bytes, ns / 1e6, in_bytes / 1048576 / (ns / 1e9),
+                           rss, peak, rd, cmp, wr
+                }'
+            done
+        done
+    done
+done
+rm -f out.tmp run.tmp stats.tmp
@@ -0,0 +1,120 @@
+#!/bin/bash
+# round-trip check of pzip and punzip: compresses a set of files with every format and codec and tiny chunk sizes,
+# decompresses the result and compares it with the input (pzip drops NUL bytes, so with the input without them)
+# usage: ./check.sh [work_dir], or make check; prints one line per failure and exits 1 if there was any
+# inputs are generated into work_dir (/tmp/pzip-check by default):
+#   empty    no bytes
+#   one      a single byte
+#   runs     runs of random lengths of random letters, long runs included
+#   nul      runs interleaved with NUL bytes, some of them inside runs
+#   allnul   only NUL bytes
+#   random   random bytes, NUL bytes included
+# every configuration is decompressed into a regular file (parallel, mapped) and into a pipe (serial)
+
+DIR=${1:-/tmp/pzip-check}
+BIN=$(cd "$(dirname "$0")" && pwd)
+PZIP=$BIN/pzip
+PUNZIP=$BIN/punzip
+FAILED=0
+
+mkdir -p "$DIR" || exit 1
+cd "$DIR" || exit 1
+
+: > empty
+printf 'a' > one
+awk 'BEGIN {
+    srand (1)
+    for (i = 0; i < 2000; i++) {
+        len = (i % 1000 == 500) ? 20000 : int (rand () * 12) + 1; c = sprintf ("%c", 97 + int (rand () * 4))
+        for (j = 0; j < len; j++) printf "%s", c
+    }
+}' > runs
+head -c 20000 runs | sed 's/aaaa/aazaa/g; s/b/z/g' | tr 'z' '\0' > nul
+head -c 5000 /dev/zero > allnul
+head -c 30000 /dev/urandom > random
+
+# report a failure
+fail () {
+    echo "FAIL: $*"
+    FAILED=1
+}
+
+# compress files with options, decompress to a file and to a pipe and compare with the input without NUL bytes
+check () {
+    local opts=$1
+    shift
+    cat "$@" | tr -d '\0' > expected
+    "$PZIP" $opts "$@" > out.z || { fail "pzip $opts $*"; return; }
+    "$PUNZIP" out.z > got || fail "punzip (file) after pzip $opts $*"
+    cmp -s expected got || fail "output differs (file): pzip $opts $*"
+    "$PUNZIP" out.z | cat > got || fail "punzip (pipe) after pzip $opts $*"
+    cmp -s expected got || fail "output differs (pipe): pzip $opts $*"
+}
+
+for format in "" "-f" "-c varint"; do
+    for chunk in 1 7 64 1K; do
+        for threads in 1 3; do
+            opts="$format -b $chunk -t $threads"
+            check "$opts" one
+            check "$opts" nul
+            check "$opts" allnul
+            check "$opts" runs nul one empty runs
+            [ "$chunk" != 1 ] && check "$opts" random nul
+        done
+    done
+    # streaming input
+    cat runs nul | "$PZIP" $format -b 1K -t 3 > out.z || fail "pzip $format (stdin)"
+    cat runs nul | tr -d '\0' > expected
+    "$PUNZIP" out.z > got && cmp -s expected got || fail "output differs: pzip $format (stdin)"
+done
+
+# several compressed files decompress into the concatenation of their inputs
+"$PZIP" -f -b 7 runs > a.z && "$PZIP" -b 64 nul > b.z && "$PZIP" -c varint -b 1K one > c.z
+cat runs nul one | tr -d '\0' > expected
+"$PUNZIP" a.z b.z c.z > got && cmp -s expected got || fail "output differs: punzip a.z b.z c.z"
+
+# an input that cannot be opened is an error
+"$PUNZIP" does-not-exist > got 2> /dev/null && fail "punzip does-not-exist exited 0"
+
+# invalid options are reported on STDERR before anything is written to the output
+for opts in "-f -a 99" "-c nope" "-s nope" "-b 64M -m 1" "-b abc" "-b 0" "-b 4x" "-t x" "-t 0" "-m x"; do
+    "$PZIP" $opts one > out.z 2> /dev/null && fail "pzip $opts exited 0"
+    [ -s out.z ] && fail "pzip $opts wrote to the output"
+done
+
+# a corrupt framed file is an error (exit status 1), never decoded as legacy units
+"$PZIP" -f -b 64 runs > f.z
+"$PZIP" -c varint -b 64 runs > v.z
+size=$(wc -c < f.z)
+index=$(od -An -t u8 -j $((size - 24)) -N 8 f.z | tr -d ' ')
+# overwrite bytes of f.z (or of the file given third) at an offset with a value given as \x escapes
+patch () {
+    cp "${3:-f.z}" bad.z
+    printf "$2" | dd of=bad.z bs=1 seek="$1" conv=notrunc status=none
+}
+check_corrupt () {
+    timeout 10 "$PUNZIP" $2 bad.z > got 2> /dev/null
+    [ $? = 1 ] || fail "corrupt framed file not rejected: $1 $2"
+}
+head -c 40 f.z > bad.z; check_corrupt "truncated to 40 bytes"
+head -c 100 v.z > bad.z; check_corrupt "varint truncated to 100 bytes"
+patch $((size - 16)) '\x00\xca\x9a\x3b\x00\x00\x00\x00'; check_corrupt "1e9 frames"
+patch "$index" '\x00\x10\xa5\xd4\xe8\x00\x00\x00'; check_corrupt "frame offset 1e12"
+patch $((index + 24 + 8)) '\x01\x00\x00\x00\x00\x00\x00\x00'; check_corrupt "raw offset out of order"
+patch $((index + 24 + 16)) '\x01\x00\x00\x00\x00\x00\x00\x00'; check_corrupt "raw length does not match the frame"
+# the payload of the first frame starts after the file header (16 bytes) and the frame header (24 bytes)
+patch 40 '\xe8\x03\x00\x00'; check_corrupt "unit count over the raw length"; check_corrupt "unit count over the raw length" "-r 0:1"
+patch 40 '\x01\x00\x00\x00'; check_corrupt "unit count under the raw length"
+patch 40 '\xff\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01' v.z; check_corrupt "varint longer than 10 bytes"
+patch 40 '\x02' v.z; check_corrupt "varint run under the raw length"
+
+# -r takes start:end, start:, or start, with start <= end
+for range in abc 7:3 5:x -1:4; do
+    "$PUNZIP" -r "$range" f.z > got 2> /dev/null && fail "punzip -r $range exited 0"
+done
+tr -d '\0' < runs | head -c 10 | tail -c 7 > expected
+"$PUNZIP" -r 3:10 f.z > got && cmp -s expected got || fail "output differs: punzip -r 3:10"
+
+rm -f expected got out.z a.z b.z c.z f.z v.z bad.z
+[ "$FAILED" = 0 ] && echo "all ok"
+exit $FAILED
@@ -0,0 +1,489 @@
+#include <stdio.h>          // IO operations
+#include <stdlib.h>         // malloc
+#include <stdint.h>         // portable int type
+#include <fcntl.h>          // file descriptor fields
+#include <assert.h>         // assert
+#include <pthread.h>        // pthreads
+#include <sys/mman.h>       // mmap
+#include <sys/stat.h>       // file stats
+#include <sys/sysinfo.h>    // get nprocs for CPU cores
+#include <unistd.h>         // close
+#include <string.h>         // memset
+#include <errno.h>          // EINTR
+#include "pzip.h"           // output formats
+
+/*
+punzip: parallel decompressor for pzip output
+usage: punzip [-r start:end] file1 [file2 ...] > out, the files are decompressed one after the other
+Every input file is mapped and split into ranges of units, claimed by the threads from a shared counter:
+legacy format: one range per thread
+    pass 1: every thread sums the counts of its range; an exclusive prefix sum over the sums of the ranges gives the
+            offset of every range in the output
+framed format: one range per frame, the decoded offset of every frame is in the index, there is no pass 1
+pass 2: every thread expands the runs of its ranges with memset() at their offset, into the output file mapped into
+        memory (or through a buffer written with pwrite() when the output cannot be mapped)
+When the output is not a regular file (pipes, terminals), the ranges are expanded serially and written in order.
+-r only writes bytes [start, end) of the decompressed output of all the files; with the framed format only the frames
+overlapping the range are read, found with a binary search on the index.
+pzip drops NUL bytes, so the output is byte-identical to the original for input without NUL bytes.
+*/
+
+// macro constants
+#define WRITE_BUF_SIZE (1024*1024)          // buffer expanding runs that are written out instead of mapped
+
+// macro functions
+#define MIN(a,b) (((a)<(b))?(a):(b))    // return minimum of two numbers
+#define MAX(a,b) (((a)>(b))?(a):(b))    // return maximum of two numbers
+
+// units decompressed by one thread at a time
+typedef struct __range_t {
+    unsigned char *begin;       // first unit
+    unsigned char *end;         // end of the last unit
+    uint64_t size;              // bytes once expanded
+    uint64_t offset;            // position of the first byte in the decompressed output of all the files
+} range_t;
+
+// global variables
+int g_threads;                  // number of decompressing threads
+range_t *g_ranges;              // ranges of the current file
+uint64_t g_n_ranges;            // number of ranges of the current file
+uint64_t g_next_range;          // next range to be claimed by a thread
+uint64_t g_lo, g_hi;            // bytes of the decompressed output that are written (-r)
+uint64_t g_slice_lo;            // first byte of the current file that is written
+char *g_out;                    // mapped output of byte g_slice_lo, NULL if the output is written instead
+off_t g_out_offset;             // output offset of byte g_slice_lo, < 0 when writing at the file position (serial mode)
+uint64_t g_codec;               // codec of the current file, CODEC_UNITS for the legacy format
+const char *g_name;             // name of the current file, for errors
+
+// write all of a buffer at offset (at the file position if offset < 0), write() may write less than asked for
+void write_all (int fd, char *buf, uint64_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t bytes = (offset < 0) ? write (fd, buf, len) : pwrite (fd, buf, len, offset);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        assert (bytes > 0);
+        buf += bytes;
+        len -= bytes;
+        if (offset >= 0)
+            offset += bytes;
+    }
+}
+
+// count routine (pass 1): number of bytes the units of a range expand to
+void count_range (range_t *range)
+{
+    uint64_t size = 0;
+    for (unsigned char *unit = range->begin; unit < range->end; unit += UNIT_SIZE)
+        size += *(uint32_t *) unit;
+    range->size = size;
+}
+
+// where expand_range writes the bytes of a range
+typedef struct __sink_t {
+    uint64_t skip;              // bytes of the range before g_lo, not written
+    uint64_t left;              // bytes left to write before g_hi
+    char *out;                  // mapped output, or NULL
+    char *buf;                  // buffer written out whenever it is full, when the output is not mapped
+    uint64_t len;               // bytes in the buffer
+    off_t offset;               // output offset of the buffer, < 0 when writing at the file position
+} sink_t;
+
+// decoded bytes of a range: count times ch, or the count bytes at literal
+void put_bytes (sink_t *sink, unsigned char ch, unsigned char *literal, uint64_t count)
+{
+    if (sink->skip >= count)
+    {
+        sink->skip -= count;
+        return;
+    }
+    if (literal != NULL)
+        literal += sink->skip;
+    count = MIN (count - sink->skip, sink->left);
+    sink->skip = 0;
+    sink->left -= count;
+
+    // mapped output, the runs are expanded in place
+    if (sink->out != NULL)
+    {
+        if (literal != NULL)
+            memcpy (sink->out, literal, count);
+        else
+            memset (sink->out, ch, count);
+        sink->out += count;
+        return;
+    }
+
+    // runs are expanded into a buffer, written out whenever it is full
+    while (count > 0)
+    {
+        uint64_t n = MIN (count, WRITE_BUF_SIZE - sink->len);
+        if (literal != NULL)
+        {
+            memcpy (sink->buf + sink->len, literal, n);
+            literal += n;
+        }
+        else
+            memset (sink->buf + sink->len, ch, n);
+        sink->len += n;
+        count -= n;
+        if (sink->len == WRITE_BUF_SIZE) // buffer full
+        {
+            write_all (STDOUT_FILENO, sink->buf, sink->len, sink->offset);
+            if (sink->offset >= 0)
+                sink->offset += sink->len;
+            sink->len = 0;
+        }
+    }
+}
+
+// a framed file that does not hold together: nothing sensible can be decoded from it
+void corrupt (const char *name, const char *what)
+{
+    fprintf (stderr, "punzip: %s: corrupt framed file: %s\n", name, what);
+    exit(1);
+}
+
+/* expand routine (pass 2): expand the runs of a range that fall in [g_lo, g_hi) at their offset in the output;
+the whole range is decoded even when -r ends inside it, its units or tokens must add up to exactly range->size */
+void expand_range (range_t *range)
+{
+    uint64_t lo = MAX (g_lo, range->offset);
+    uint64_t hi = MIN (g_hi, range->offset + range->size);
+    if (lo >= hi) // nothing to write
+        return;
+    sink_t sink = {lo - range->offset, hi - lo, NULL, NULL, 0, -1};
+    if (g_out != NULL)
+        sink.out = g_out + (lo - g_slice_lo);
+    else
+    {
+        sink.buf = malloc (WRITE_BUF_SIZE);
+        assert (sink.buf != NULL);
+        if (g_out_offset >= 0)
+            sink.offset = g_out_offset + (off_t) (lo - g_slice_lo);
+    }
+
+    unsigned char *ptr = range->begin;
+    uint64_t decoded = 0;
+    if (g_codec == CODEC_UNITS)
+    {
+        for (; ptr < range->end; ptr += UNIT_SIZE)
+        {
+            uint32_t count = *(uint32_t *) ptr;
+            if (count > range->size - decoded)
+                corrupt (g_name, "frame decodes to more bytes than its raw length");
+            if (sink.left > 0)
+                put_bytes (&sink, ptr[sizeof(uint32_t)], NULL, count);
+            decoded += count;
+        }
+    }
+    else // varint tokens
+    {
+        while (ptr < range->end)
+        {
+            uint64_t token = 0;
+            for (int shift = 0; ; shift += 7)
+            {
+                if (ptr == range->end || shift > 63) // truncated, or longer than the 10 bytes of a 64-bit varint
+                    corrupt (g_name, "bad varint");
+                token |= (uint64_t) (*ptr & 0x7F) << shift;
+                if (!(*ptr++ & 0x80))
+                    break;
+            }
+            uint64_t count = (token & 1) ? (token >> 1) + 1 : token >> 1;
+            if ((uint64_t) (range->end - ptr) < ((token & 1) ? count : 1)) // truncated payload
+                corrupt (g_name, "truncated varint payload");
+            if (count > range->size - decoded)
+                corrupt (g_name, "frame decodes to more bytes than its raw length");
+            if (sink.left > 0)
+                put_bytes (&sink, *ptr, (token & 1) ? ptr : NULL, count);
+            ptr += (token & 1) ? count : 1;
+            decoded += count;
+        }
+    }
+    if (decoded != range->size)
+        corrupt (g_name, "frame decodes to fewer bytes than its raw length");
+
+    if (sink.buf != NULL)
+    {
+        write_all (STDOUT_FILENO, sink.buf, sink.len, sink.offset);
+        free (sink.buf);
+    }
+}
+
+// thread routine: run one pass over the ranges claimed from the shared counter
+void *pass_routine (void *arg)
+{
+    void (*pass) (range_t *) = *(void (**) (range_t *)) arg;
+    uint64_t i;
+    while ((i = __atomic_fetch_add (&g_next_range, 1, __ATOMIC_RELAXED)) < g_n_ranges)
+        pass (&g_ranges[i]);
+    return 0;
+}
+
+// run one pass over every range of the current file, in parallel
+void run_pass (void (*pass) (range_t *))
+{
+    int rc;
+    int n_threads = MIN ((uint64_t) g_threads, g_n_ranges);
+    pthread_t threads[g_threads];
+    g_next_range = 0;
+    for (int i = 0; i < n_threads; i++)
+    {
+        rc = pthread_create (&threads[i], NULL, pass_routine, &pass);
+        assert (rc == 0);
+    }
+    for (int i = 0; i < n_threads; i++)
+        pthread_join (threads[i], NULL);
+}
+
+/* framed format: one range per frame overlapping [g_lo, g_hi), found with a binary search on the index;
+pos is the decompressed offset of the file, returns its decompressed size, or -1 if the file is not framed
+(no FRAME_MAGIC); once the magic matches, a footer, an index or a frame header that does not hold together
+is an error: the index is checked up front (every frame lies between the file header and the index, in order,
+and the decoded offsets follow each other from 0), the header of a frame only when the frame is selected (its
+payload ends before the next frame and it matches its index entry), so seeking with -r stays O(log n_frames) */
+int64_t find_frames (const char *name, unsigned char *input, uint64_t size, uint64_t pos)
+{
+    file_header_t header;
+    file_footer_t footer;
+    if (size < sizeof(header.magic) || memcmp (input, FRAME_MAGIC, sizeof(header.magic)) != 0)
+        return -1;
+    if (size < sizeof(header) + sizeof(footer))
+        corrupt (name, "truncated");
+    memcpy (&header, input, sizeof(header));
+    memcpy (&footer, input + size - sizeof(footer), sizeof(footer));
+    if (memcmp (footer.magic, INDEX_MAGIC, sizeof(footer.magic)) != 0)
+        corrupt (name, "no footer");
+    uint64_t frames_end = size - sizeof(footer); // end of the index
+    if (footer.index_offset < sizeof(header) || footer.index_offset > frames_end
+        || footer.n_frames != (frames_end - footer.index_offset) / sizeof(index_entry_t)
+        || (frames_end - footer.index_offset) % sizeof(index_entry_t) != 0)
+        corrupt (name, "index does not fit the file");
+    g_codec = header.codec;
+    if (g_codec != CODEC_UNITS && g_codec != CODEC_VARINT)
+    {
+        fprintf (stderr, "punzip: unknown codec %llu\n", (unsigned long long) header.codec);
+        exit(1);
+    }
+    index_entry_t *index = (index_entry_t *) (input + footer.index_offset);
+    uint64_t next_offset = sizeof(header);  // frames follow each other
+    uint64_t next_raw = 0;                  // and so do their decoded bytes
+    for (uint64_t i = 0; i < footer.n_frames; i++)
+    {
+        if (index[i].offset < next_offset || index[i].offset > footer.index_offset
+            || footer.index_offset - index[i].offset < sizeof(frame_header_t))
+            corrupt (name, "frame outside the file");
+        if (index[i].raw_offset != next_raw || index[i].raw_length > INT64_MAX - next_raw)
+            corrupt (name, "decoded offsets out of order");
+        next_offset = index[i].offset + sizeof(frame_header_t);
+        next_raw += index[i].raw_length;
+    }
+    g_ranges = malloc (MAX (1, footer.n_frames) * sizeof(range_t));
+    assert (g_ranges != NULL);
+    if (footer.n_frames == 0)
+        return 0;
+
+    // first frame ending after g_lo
+    uint64_t lo = 0, hi = footer.n_frames;
+    while (lo < hi)
+    {
+        uint64_t mid = (lo + hi) / 2;
+        if (pos + index[mid].raw_offset + index[mid].raw_length <= g_lo)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (uint64_t i = lo; i < footer.n_frames && pos + index[i].raw_offset < g_hi; i++)
+    {
+        frame_header_t frame;
+        memcpy (&frame, input + index[i].offset, sizeof(frame));
+        uint64_t frame_end = (i + 1 < footer.n_frames) ? index[i + 1].offset : footer.index_offset;
+        if (frame.payload_size > frame_end - index[i].offset - sizeof(frame))
+            corrupt (name, "frame outside the file");
+        if (g_codec == CODEC_UNITS && frame.payload_size % UNIT_SIZE != 0)
+            corrupt (name, "partial unit");
+        if (frame.raw_offset != index[i].raw_offset || frame.raw_length != index[i].raw_length)
+            corrupt (name, "frame header does not match the index");
+        range_t *range = &g_ranges[g_n_ranges++];
+        range->begin = input + index[i].offset + sizeof(frame);
+        range->end = range->begin + frame.payload_size;
+        range->size = frame.raw_length;
+        range->offset = pos + frame.raw_offset;
+    }
+    return next_raw;
+}
+
+// print the usage on STDERR and exit
+void usage ()
+{
+    fprintf (stderr, "punzip: [-r start:end] file1 [file2 ...]\n");
+    exit(1);
+}
+
+// perform parallel decompression
+int main (int argc, const char* argv[])
+{
+    // used for various return codes
+    int rc = -1;
+
+    // options
+    int opt;
+    g_lo = 0;
+    g_hi = UINT64_MAX;
+    while ((opt = getopt (argc, (char * const *) argv, "r:")) != -1)
+    {
+        char *end;
+        switch (opt)
+        {
+            case 'r': // byte range start:end of the decompressed output, end may be left out
+                if (optarg[0] < '0' || optarg[0] > '9')
+                    usage ();
+                g_lo = strtoull (optarg, &end, 10);
+                if (*end == ':' && end[1] != '\0')
+                {
+                    const char *hi = end + 1;
+                    if (hi[0] < '0' || hi[0] > '9')
+                        usage ();
+                    g_hi = strtoull (hi, &end, 10);
+                }
+                else if (*end == ':')
+                    end++;
+                if (*end != '\0' || g_lo > g_hi)
+                    usage ();
+                break;
+            default:
+                usage ();
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // must take atleast one input file as argument
+    if (argc < 2)
+        usage ();
+
+    // number of CPU cores, one thread per core
+    int cpu_cores = get_nprocs();
+    assert (cpu_cores > 0);
+    g_threads = cpu_cores;
+
+    /* output: a regular file (not opened for appending) is decompressed into in parallel from the current file
+    position; mapping it needs read access, so it is reopened read-write, otherwise the threads pwrite() it */
+    struct stat out_stat;
+    int parallel = fstat (STDOUT_FILENO, &out_stat) == 0 && S_ISREG (out_stat.st_mode)
+                   && !(fcntl (STDOUT_FILENO, F_GETFL) & O_APPEND);
+    off_t out_start = parallel ? lseek (STDOUT_FILENO, 0, SEEK_CUR) : -1;
+    parallel = parallel && out_start >= 0;
+    int map_fd = parallel ? open ("/proc/self/fd/1", O_RDWR) : -1;
+    long page_size = sysconf (_SC_PAGESIZE);
+
+    uint64_t pos = 0; // decompressed offset of the current file
+    off_t out_pos = out_start; // end of the output so far
+    for (int i = 1; i < argc && pos < g_hi; i++)
+    {
+        // a file that cannot be opened is an error, the output would be missing its bytes
+        int fd = open(argv[i], O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf (stderr, "punzip: cannot open %s: %s\n", argv[i], strerror (errno));
+            exit(1);
+        }
+        struct stat stat_buf;
+        fstat (fd, &stat_buf);
+        uint64_t size = stat_buf.st_size;
+        if (size == 0) // nothing to expand
+        {
+            close(fd);
+            continue;
+        }
+        unsigned char *input = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        assert (input != MAP_FAILED);
+        close(fd);
+
+        // ranges: the frames, or one per thread (legacy format)
+        g_n_ranges = 0;
+        g_name = argv[i];
+        int64_t file_size = find_frames (argv[i], input, size, pos);
+        if (file_size < 0)
+        {
+            g_codec = CODEC_UNITS;
+            uint64_t n_units = size / UNIT_SIZE;
+            g_ranges = malloc (g_threads * sizeof(range_t));
+            assert (g_ranges != NULL);
+            if (size % UNIT_SIZE != 0)
+                fprintf (stderr, "punzip: %s: trailing partial unit ignored\n", argv[i]);
+            rc = madvise(input, size, MADV_SEQUENTIAL);
+            assert (rc == 0);
+            g_n_ranges = parallel ? g_threads : 1;
+            for (uint64_t t = 0; t < g_n_ranges; t++)
+            {
+                g_ranges[t].begin = input + (n_units * t / g_n_ranges) * UNIT_SIZE;
+                g_ranges[t].end = input + (n_units * (t + 1) / g_n_ranges) * UNIT_SIZE;
+            }
+
+            // pass 1, then the offset of every range is the sum of the sizes of the ranges before it
+            if (parallel)
+                run_pass (count_range);
+            else
+                count_range (&g_ranges[0]);
+            file_size = 0;
+            for (uint64_t t = 0; t < g_n_ranges; t++)
+            {
+                g_ranges[t].offset = pos + file_size;
+                file_size += g_ranges[t].size;
+            }
+        }
+
+        // bytes of this file that are written
+        g_slice_lo = MAX (g_lo, pos);
+        uint64_t slice_hi = MIN (g_hi, pos + file_size);
+        uint64_t total = (slice_hi > g_slice_lo) ? slice_hi - g_slice_lo : 0;
+
+        // serial fallback: the ranges are expanded in order and written at the file position
+        if (!parallel)
+        {
+            g_out = NULL;
+            g_out_offset = -1;
+            for (uint64_t r = 0; r < g_n_ranges; r++)
+                expand_range (&g_ranges[r]);
+        }
+        else if (total > 0)
+        {
+            // map the output of this file, from the page holding its first byte
+            g_out = NULL;
+            g_out_offset = out_pos;
+            char *map = MAP_FAILED;
+            off_t map_start = out_pos - out_pos % page_size;
+            uint64_t map_len = out_pos + total - map_start;
+            if (map_fd >= 0 && ftruncate (map_fd, out_pos + total) == 0)
+                map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, map_fd, map_start);
+            if (map != MAP_FAILED)
+                g_out = map + (out_pos - map_start);
+
+            // pass 2
+            run_pass (expand_range);
+            if (map != MAP_FAILED)
+            {
+                rc = munmap (map, map_len);
+                assert (rc == 0);
+            }
+        }
+        free (g_ranges);
+        munmap (input, size);
+        pos += file_size;
+        out_pos += total;
+    }
+
+    // leave the file position after the output
+    if (parallel)
+    {
+        rc = (lseek (STDOUT_FILENO, out_pos, SEEK_SET) < 0);
+        assert (rc == 0);
+    }
+    if (map_fd >= 0)
+        close (map_fd);
+
+    return EXIT_SUCCESS;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE                 // CPU affinity of threads
 #include <stdio.h>          // IO operations
 #include <stdlib.h>         // portable int type
 #include <stdint.h>         // malloc
@@ -9,10 +10,28 @@
 #include <sys/stat.h>       // file stats
 #include <sys/sysinfo.h>    // get nprocs for CPU cores
 #include <unistd.h>         // close
-#include <semaphore.h>      // semaphores
+#include <limits.h>         // INT_MAX
+#include <linux/futex.h>    // futex operations
+#include <sys/syscall.h>    // futex system call
+#include <string.h>         // strcmp
+#include <errno.h>          // EINTR
+#include <sys/uio.h>        // writev
+#include <sys/resource.h>   // getrusage for the footprint report
+#include <time.h>           // clock_gettime for the stage times
+#include <sched.h>          // CPU sets
+#include <dirent.h>         // NUMA nodes in sysfs
+#include <sys/sysmacros.h>  // major and minor of the output device
+#include <getopt.h>         // long options
+#include "pzip.h"           // output formats
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>      // SSE2/AVX2/AVX-512 run detection kernels
+#define PZIP_X86
+#endif
 
 /*
-n_chunk chunks are mapped to n_slots slots
+n_chunk chunks are mapped to n_slots slots, chunk i uses slot i % n_slots
+C threads claim the next chunk from a shared counter whenever they are done with one (dynamic scheduling),
+so a slow chunk or a descheduled thread does not hold up chunks that other threads could compress
 Brief Summary:
 A chunk can be in 3 possible states: Assigned, Compressed, Freed
 Assigned: 
@@ -24,12 +43,31 @@ Compressed:
 Freed:
     chunk has been compressed and written (attached to previous compressor by W thread from its slot buffer. The corresponding slot 
     buffer is freed up and W thread signals for the C thread to use the freed slot buffer.
+pwrite mode (output is a regular file): there is no W thread, a C thread places its chunk in the output after the
+previous one (a running prefix sum of the output lengths, fixing up the run that crosses the chunk boundary),
+then writes it at its own offset with pwritev() in parallel with the other C threads and frees the slot
+Handoff: a ring of per-slot sequence words instead of semaphores. A sequence word only grows and counts chunks:
+the compressed word of a slot is published (release) as chunk + 1 once C is done with the chunk, the released word
+counts the chunks whose slot has been freed, so chunk i may use its slot once i < released + n_slots. A waiter loads
+the word (acquire), spins a while, then sleeps in futex_wait; a publisher only makes the futex_wake system call when
+someone sleeps, so the handoff of a chunk costs no system call while the threads keep up with each other
 */
 
 // macro constants
-//#define MAX_CHUNK_SIZE (500*1024*1024)      // 10MB chunks
 #define SLOTS_PER_CPU 10                    // number of slots per CPU
-#define UNIT_SIZE 5                         // size of each compressed unit is 5 bytes (4 bytes integer + 1 byte char) in binary
+#define STREAM_CHUNK_SIZE (4*1024*1024)     // chunk size when reading STDIN or pipes, whose size is not known up front
+#define MEMORY_BUDGET (1024ULL*1024*1024)   // default cap on slot buffer memory (-m to change)
+#define MIN_CHUNK_SIZE (64*1024)            // chunks are not shrunk below this size to fit the memory budget
+#define SLOT_INIT_SIZE (64*1024)            // initial size of a slot buffer, doubled on demand
+#define CHUNKS_PER_COMPRESSOR 8             // chunks are made small enough for every C thread to get several of them
+#define MIN_AUTO_CHUNK_SIZE (4*1024)        // smallest chunk the tuner picks to give every C thread several chunks
+#define CHUNK_MIN_NS (200*1000)             // the tuner makes chunks take at least this long to compress
+#define SAMPLE_SIZE (16*1024)               // bytes compressed by each probe of the tuner's sampling pass
+#define SAMPLE_COUNT 4                      // probes spread over the input
+#define DEFAULT_L2_SIZE (512*1024)          // L2 cache size assumed when sysconf and sysfs do not know it
+#define SPIN_MAX 2048                       // most checks of a sequence word before sleeping on it
+#define WRITE_BATCH 64                      // most slots written out by W with one writev() call
+#define HEAD_SIZE sizeof(frame_header_t)    // room for what is written before the contents of a slot (a unit or a frame header)
 
 // macro functions
 #define MIN(a,b) (((a)<(b))?(a):(b))    // return minimum of two numbers
@@ -38,25 +76,227 @@ Freed:
 // arguments to compressor threads
 typedef struct __C_arg_t {
     int id;                     // represent index or id of the chunk that is being compressed
+    int cpu;                    // CPU the thread is pinned to, -1 if not pinned
 } C_arg_t;
 
+// sequence word of the handoff ring, counts chunks and only grows (modulo 2^32, chunk indexes stay below 2^32)
+typedef struct __seq_t {
+    uint32_t value;             // published with release, loaded with acquire
+    uint32_t sleepers;          // threads in futex_wait on value, the publisher skips futex_wake when there are none
+} seq_t;
+
 // circular buffer struct
 typedef struct __buf_t {
     char **data;                // actual data buffer
-    sem_t *compressed;          // make W wait for C to compress a chunk into a slot before writing to output
-    sem_t *freed;               // make C wait for W to write slot content to output before C starts compressing new chunk to slot
+    uint64_t *size;             // bytes allocated for each slot buffer, grown on demand up to g_bytes_per_slot
+    uint64_t *len;              // bytes of compressed units in each slot buffer
+    uint64_t *raw_len;          // framed format only: bytes the contents of each slot buffer decode to
+    seq_t *compressed;          // chunk + 1 once C has compressed the chunk into the slot, W waits for it
+                                // (pwrite mode: chunk + 1 once the chunk may be placed in the output, after the previous one)
+    seq_t released;             // chunks whose slot has been freed, in chunk order: chunk i waits until i < released + n_slots
     int n_slots;                // # of slots
+    // streaming mode only: the reader(R) thread fills the input buffer of a freed slot and hands it to C
+    char **input;               // input buffer of each slot, g_chunk_size bytes
+    uint64_t *input_len;        // bytes read into the input buffer
+    int *end;                   // set instead of reading when the input is exhausted, C and W stop at this chunk
+    seq_t *filled;              // chunk + 1 once R has read the chunk into the slot, C waits for it
+    // pwrite mode only: chunks are written out of order, but slots are still freed in chunk order
+    uint32_t *written;          // chunk + 1 once the chunk in the slot has been written
 } buf_t;
 
+// run being counted while a chunk is compressed, carried from one piece of the chunk to the next
+typedef struct __run_t {
+    unsigned char ch;           // repeated character
+    uint32_t count;             // repetitions so far, 0 before the first character
+    uint64_t raw;               // bytes of the runs written to the slot so far, once decoded
+    int64_t literal;            // varint codec: offset in the slot of the header of the literal being extended, -1 if none
+} run_t;
+
+// input file mapped read-only, placed at its offset in the virtual concatenation of all input files
+typedef struct __input_t {
+    char *begin;                // mapping start address
+    uint64_t size;              // file size
+    uint64_t offset;            // position of the first byte in the concatenated input
+} input_t;
+
 // global variables
-char *g_map_begin;              // file start address
-char *g_map_end;                // file end address
+input_t *g_inputs;              // mapped input files, in command line order (empty files are left out)
+int g_n_inputs;                 // number of mapped input files
+uint64_t g_input_size;          // total size of the concatenated input
 buf_t *g_buf;                   // slot buffer struct
 int g_compressors;              // number of compressor(C) threads
 uint64_t g_chunk_size;          // chunk size chosen for compression
 uint64_t g_n_chunks;            // number of chunks
-uint64_t g_bytes_per_slot;      // size of buffer chosen for each compression thread
-FILE *fpout;                    // output pointer
+uint64_t g_next_chunk;          // next chunk to be claimed by a C thread
+uint64_t g_bytes_per_slot;      // largest size of a slot buffer (a chunk without any repeating character)
+uint64_t g_memory_budget;       // cap on the worst-case size of all slot buffers
+uint64_t g_pool_bytes;          // bytes of slot and input buffers currently allocated
+uint64_t g_pool_peak;           // largest value of g_pool_bytes
+int g_streaming;                // input is read by the R thread, chunks are not known up front
+const char **g_stream_files;    // files read one after the other by R, "-" is STDIN
+int g_n_stream_files;           // number of files read by R
+int g_pwrite;                   // C threads write their chunks at their own output offset, no W thread
+off_t g_out_base;               // pwrite mode: output offset of the first byte
+uint64_t g_placed;              // output bytes of the chunks placed so far (without the carry)
+run_t g_carry;                  // last unit of the chunks placed so far, held back
+int g_framed;                   // write the framed format instead of a flat stream of units
+uint64_t g_raw_placed;          // framed format: decoded bytes of the frames placed so far
+index_entry_t *g_index;         // framed format: index entry of every frame placed so far
+uint64_t g_n_frames;            // number of index entries
+uint64_t g_index_size;          // index entries allocated
+uint64_t g_read_ns;             // time spent reading the input: read() calls of R, or mapping the input files
+uint64_t g_compress_ns;         // time spent compressing chunks, summed over the C threads
+uint64_t g_write_ns;            // time spent writing the output, summed over the threads writing it
+
+// per-thread counters and timers of --stats, to size the slots and chunks from data
+typedef struct __stats_t {
+    uint64_t start_ns;          // thread started
+    uint64_t end_ns;            // thread returned
+    uint64_t compress_ns;       // compressing chunks (C)
+    uint64_t read_ns;           // reading the input (R)
+    uint64_t write_ns;          // writing the output (W, or C in pwrite mode)
+    uint64_t wait_slot_ns;      // blocked waiting for a free slot (C, R)
+    uint64_t wait_chunk_ns;     // blocked waiting for a chunk: compressed (W), read (C when streaming) or its turn to be placed (C in pwrite mode)
+    uint64_t stalls;            // waits that blocked
+    uint64_t chunks;            // chunks compressed (C), written (W) or read (R)
+    uint64_t bytes_in;          // bytes compressed (C) or read (R)
+    uint64_t bytes_out;         // compressed bytes produced (C) or written (W)
+    uint64_t runs;              // runs encoded (C)
+} stats_t;
+
+stats_t *g_stats;               // counters of every thread with --stats: C threads by id, then W and R
+__thread stats_t *t_stats;      // counters of the calling thread, NULL without --stats
+
+// monotonic clock in ns, for the stage times
+uint64_t now_ns ()
+{
+    struct timespec ts;
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// start counting for the calling thread (index in g_stats)
+void stats_start (int index)
+{
+    if (g_stats == NULL)
+        return;
+    t_stats = &g_stats[index];
+    t_stats->start_ns = now_ns ();
+}
+
+// stop counting for the calling thread
+void stats_end ()
+{
+    if (t_stats != NULL)
+        t_stats->end_ns = now_ns ();
+}
+
+int g_spin_max;                 // SPIN_MAX with several CPUs, 0 on a single one (the publisher cannot run while we spin)
+__thread int t_spin = -1;       // checks before sleeping, adapted to how long the calling thread's waits last
+
+// the sequence word has reached target (wraps around like the word)
+int seq_reached (seq_t *seq, uint32_t target)
+{
+    return (int32_t) (__atomic_load_n (&seq->value, __ATOMIC_ACQUIRE) - target) >= 0;
+}
+
+// wake the threads sleeping on the word after it has been changed (seq_cst), if any
+void seq_wake (seq_t *seq)
+{
+    if (__atomic_load_n (&seq->sleepers, __ATOMIC_SEQ_CST) != 0)
+        syscall (SYS_futex, &seq->value, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+// publish value, seq_cst orders the store before the load of sleepers (see seq_wait)
+void seq_publish (seq_t *seq, uint32_t value)
+{
+    __atomic_store_n (&seq->value, value, __ATOMIC_SEQ_CST);
+    seq_wake (seq);
+}
+
+/* wait until the sequence word reaches target: spin first (the threads mostly keep up with each other), then sleep
+in futex_wait; a sleeper is counted before checking the word one last time, and the publisher stores the word
+before checking the count, so one of them sees the other; the spin budget of the thread doubles when spinning was
+enough and halves when it had to sleep; with --stats the time spent blocked is counted as waiting for a slot or for
+a chunk */
+enum { WAIT_SLOT, WAIT_CHUNK };
+void seq_wait (seq_t *seq, uint32_t target, int wait)
+{
+    if (seq_reached (seq, target))
+        return;
+    uint64_t start = (t_stats != NULL) ? now_ns () : 0;
+    if (t_spin < 0)
+        t_spin = g_spin_max;
+    int spins = 0;
+    while (spins < t_spin && !seq_reached (seq, target))
+    {
+#ifdef PZIP_X86
+        _mm_pause ();
+#endif
+        spins++;
+    }
+    if (spins < t_spin) // reached while spinning
+        t_spin = MIN (2 * t_spin + 1, g_spin_max);
+    else
+    {
+        t_spin /= 2;
+        __atomic_add_fetch (&seq->sleepers, 1, __ATOMIC_SEQ_CST);
+        uint32_t value;
+        while ((int32_t) ((value = __atomic_load_n (&seq->value, __ATOMIC_SEQ_CST)) - target) < 0)
+            syscall (SYS_futex, &seq->value, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0); // returns at once if value changed
+        __atomic_sub_fetch (&seq->sleepers, 1, __ATOMIC_RELAXED);
+    }
+    if (t_stats != NULL)
+    {
+        uint64_t blocked = now_ns () - start;
+        if (wait == WAIT_SLOT)
+            t_stats->wait_slot_ns += blocked;
+        else
+            t_stats->wait_chunk_ns += blocked;
+        t_stats->stalls++;
+    }
+}
+
+// wait until the slot of chunk_index is free: every chunk n_slots or more before it has been written
+void wait_slot (uint64_t chunk_index)
+{
+    seq_wait (&g_buf->released, chunk_index + 1 - g_buf->n_slots, WAIT_SLOT);
+}
+
+// parse a decimal number, 0 if arg is not one (empty, signed, trailing characters or too large)
+uint64_t parse_number (const char *arg, char **end)
+{
+    if (arg[0] < '0' || arg[0] > '9')
+        return 0;
+    errno = 0;
+    uint64_t number = strtoull (arg, end, 10);
+    return (errno != 0) ? 0 : number;
+}
+
+// parse a size in bytes, with an optional K, M or G suffix, 0 if arg is not one
+uint64_t parse_size (const char *arg)
+{
+    char *end;
+    int shift = 0;
+    uint64_t size = parse_number (arg, &end);
+    if (size == 0)
+        return 0;
+    switch (*end)
+    {
+        case 'G': case 'g': shift += 10;    // fall through
+        case 'M': case 'm': shift += 10;    // fall through
+        case 'K': case 'k': shift += 10; end++;
+    }
+    return (*end != '\0' || size > (UINT64_MAX >> shift)) ? 0 : size << shift;
+}
+
+// print the usage on STDERR and exit
+void usage ()
+{
+    fprintf (stderr, "pzip: [-a compact|spread|cpulist] [-b chunk_size] [-c codec] [-f] [-m budget_mb] [-s kernel] "
+             "[-t threads] [-v] [-w] [--stats] file1 [file2 ...]\n");
+    exit(1);
+}
 
 // get size of file specified by file descriptor
 uint64_t get_file_size (int fd)
@@ -66,11 +306,67 @@ uint64_t get_file_size (int fd)
     return stat_buf.st_size;
 }
 
-// writes to output from slot buffer
-void write_out(uint32_t count, unsigned char ch, FILE* fpout)
+// write all of an iovec array at offset (at the file position if offset < 0), writev() may write less than asked for
+void write_all (int fd, struct iovec *iov, int iovcnt, off_t offset)
+{
+    uint64_t start = now_ns ();
+    while (iovcnt > 0)
+    {
+        // at most 2 * WRITE_BATCH vectors, below IOV_MAX
+        ssize_t bytes = (offset < 0) ? writev (fd, iov, iovcnt) : pwritev (fd, iov, iovcnt, offset);
+        if (bytes < 0 && errno == EINTR)
+            continue;
+        assert (bytes >= 0);
+        if (offset >= 0)
+            offset += bytes;
+        // skip what has been written
+        while (iovcnt > 0 && (size_t) bytes >= iov->iov_len)
+        {
+            bytes -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + bytes;
+            iov->iov_len -= bytes;
+        }
+    }
+    uint64_t elapsed = now_ns () - start;
+    __atomic_add_fetch (&g_write_ns, elapsed, __ATOMIC_RELAXED);
+    if (t_stats != NULL)
+        t_stats->write_ns += elapsed;
+}
+
+// account for buffer memory allocated (or freed, bytes < 0) and keep track of the peak
+void pool_add (int64_t bytes)
 {
-    fwrite(&count, sizeof(uint32_t), 1, fpout);
-    fwrite(&ch, sizeof(unsigned char), 1, fpout);
+    uint64_t now = __atomic_add_fetch (&g_pool_bytes, bytes, __ATOMIC_RELAXED);
+    uint64_t peak = __atomic_load_n (&g_pool_peak, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n (&g_pool_peak, &peak, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// double a full slot buffer (at most to the worst case size), returns the new write position
+char *grow_slot (int slot, char* slot_ptr, char** slot_end)
+{
+    uint64_t used = slot_ptr - g_buf->data[slot];
+    uint64_t size = MIN (2 * g_buf->size[slot], g_bytes_per_slot);
+    g_buf->data[slot] = realloc (g_buf->data[slot], size);
+    assert (g_buf->data[slot] != NULL);
+    pool_add (size - g_buf->size[slot]);
+    g_buf->size[slot] = size;
+    *slot_end = g_buf->data[slot] + size;
+    return g_buf->data[slot] + used;
+}
+
+// allocate a slot buffer when a C thread first uses it, so its pages are first touched on the NUMA node of that thread
+void alloc_slot (int slot)
+{
+    g_buf->size[slot] = MIN (SLOT_INIT_SIZE, g_bytes_per_slot);
+    g_buf->data[slot] = malloc (g_buf->size[slot]); // slot memory
+    assert (g_buf->data[slot] != NULL);
+    memset (g_buf->data[slot], 0, g_buf->size[slot]);
+    pool_add (g_buf->size[slot]);
 }
 
 // writes the compressed unit to the mapped slot buffer
@@ -81,302 +377,1338 @@ void write_to_slotbuf (uint32_t count, char ch, char* ptr)
     *ptr = ch;
 }
 
-// compressor routine
-void *compressor_routine (void *arg)
+/*
+codecs: how the C threads encode runs into a slot buffer (payload formats are described in pzip.h)
+put_run writes a run of count ch at ptr, slot is the start of the slot buffer, and returns the new end of the contents
+*/
+typedef char *(*put_run_t) (uint32_t count, unsigned char ch, char* slot, char* ptr, run_t *run);
+
+// units codec: 5-byte units
+char *put_unit (uint32_t count, unsigned char ch, char* slot, char* ptr, run_t *run)
 {
-    // unpack arguments
-    C_arg_t compressor = *(C_arg_t *) arg;
-    int id = compressor.id;
+    write_to_slotbuf (count, ch, ptr);
+    return ptr + UNIT_SIZE; // 4 bytes for count, 1 byte for char
+}
 
-    int chunck_index = id;
-    char* chunk_ptr = g_map_begin + id * g_chunk_size; // current pos in file chunk currently at the beginning of chunk
-    char* chunk_end = MIN (chunk_ptr + g_chunk_size, g_map_end);
-    while (chunk_ptr < g_map_end)
+// varint codec: long runs as a varint count and the char, short runs copied into literals
+char *put_varint_rle (uint32_t count, unsigned char ch, char* slot, char* ptr, run_t *run)
+{
+    if (count >= VARINT_MIN_RUN)
     {
-        // corresponding mapped buffer slot
-        int slot = chunck_index % (g_buf->n_slots); 
-        
-        // wait until this mapped buffer slot is free
-        sem_wait (&g_buf->freed[slot]);
+        run->literal = -1; // the next short run starts a new literal
+        uint64_t token = (uint64_t) count << 1;
+        for (; token >= 0x80; token >>= 7)
+            *ptr++ = (token & 0x7F) | 0x80;
+        *ptr++ = token;
+        *ptr++ = ch;
+        return ptr;
+    }
+    for (; count > 0; count--)
+    {
+        // one more byte in the literal being extended, its 1-byte header holds the length
+        if (run->literal >= 0 && (unsigned char) slot[run->literal] < VARINT_LITERAL_FULL)
+            slot[run->literal] += 2;
+        else
+        {
+            run->literal = ptr - slot;
+            *ptr++ = 1; // literal of 1 byte
+        }
+        *ptr++ = ch;
+    }
+    return ptr;
+}
 
-        // slot is free, begin compression
-        char* slot_ptr = g_buf->data[slot]; // current pos in slot currently at the beginning
-        char* slot_end = slot_ptr + g_bytes_per_slot;  // ending address of slot
-       
-        unsigned char prev_ch = 0;
-        uint32_t count = 0;
-
-        // perform compression of chunk into slot buffer
-        while (chunk_ptr < chunk_end)
+// codecs by name, the first one is the default (-c picks one)
+typedef struct __codec_t {
+    const char *name;
+    uint64_t id;                // recorded in the framed format header
+    uint64_t worst_per_byte;    // largest encoded size of an input byte (no repeating characters)
+    int max_run_size;           // largest number of bytes put_run writes at once
+    put_run_t put_run;
+} codec_t;
+
+codec_t g_codecs[] = {
+    {"units", CODEC_UNITS, UNIT_SIZE, UNIT_SIZE, put_unit},
+    {"varint", CODEC_VARINT, 2, 6, put_varint_rle},
+};
+int g_n_codecs = sizeof(g_codecs) / sizeof(g_codecs[0]);
+codec_t *g_codec;               // codec used by the C threads
+
+// write a run to a slot buffer with the codec, returns the new end of the slot contents
+char *put_run (uint32_t count, unsigned char ch, run_t *run, int slot, char* slot_ptr, char** slot_end)
+{
+    if (*slot_end - slot_ptr < g_codec->max_run_size) // slot buffer full
+        slot_ptr = grow_slot (slot, slot_ptr, slot_end);
+    run->raw += count;
+    if (t_stats != NULL)
+        t_stats->runs++;
+    return g_codec->put_run (count, ch, g_buf->data[slot], slot_ptr, run);
+}
+
+// index of the input file holding byte pos of the concatenated input (binary search on offsets)
+int find_input (uint64_t pos)
+{
+    int lo = 0, hi = g_n_inputs - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (g_inputs[mid].offset <= pos)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo;
+}
+
+/*
+run detection kernels: starting at ptr, skip every byte that is ch or NUL and count the ch bytes among them;
+return the first byte that ends the run (or end); NUL bytes are dropped from the output, so they do not break a run
+the SIMD versions compare a whole vector against ch and against 0, movemask turns the comparisons into bit masks
+and the first zero bit of (eq | nul), found with count-trailing-zeros, is the end of the run
+*/
+typedef unsigned char *(*run_kernel_t) (unsigned char* ptr, unsigned char* end, unsigned char ch, uint64_t *count);
+
+unsigned char *run_end_scalar (unsigned char* ptr, unsigned char* end, unsigned char ch, uint64_t *count)
+{
+    uint64_t n = 0;
+    for (; ptr < end; ptr++)
+    {
+        if (*ptr == ch)
+            n++;
+        else if (*ptr != '\0')
+            break;
+    }
+    *count = n;
+    return ptr;
+}
+
+#ifdef PZIP_X86
+__attribute__((target("sse2")))
+unsigned char *run_end_sse2 (unsigned char* ptr, unsigned char* end, unsigned char ch, uint64_t *count)
+{
+    uint64_t n = 0;
+    __m128i vch = _mm_set1_epi8 ((char) ch), vnul = _mm_setzero_si128 ();
+    while (end - ptr >= 16)
+    {
+        __m128i v = _mm_loadu_si128 ((__m128i *) ptr);
+        unsigned eq = _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, vch));
+        unsigned in = eq | _mm_movemask_epi8 (_mm_cmpeq_epi8 (v, vnul));
+        if (in != 0xFFFF) // the run ends in this vector
         {
-            if(*chunk_ptr == '\0')
+            int k = __builtin_ctz (~in);
+            *count = n + __builtin_popcount (eq & ((1u << k) - 1));
+            return ptr + k;
+        }
+        n += __builtin_popcount (eq);
+        ptr += 16;
+    }
+    uint64_t tail;
+    ptr = run_end_scalar (ptr, end, ch, &tail);
+    *count = n + tail;
+    return ptr;
+}
+
+__attribute__((target("avx2,popcnt,bmi")))
+unsigned char *run_end_avx2 (unsigned char* ptr, unsigned char* end, unsigned char ch, uint64_t *count)
+{
+    uint64_t n = 0;
+    __m256i vch = _mm256_set1_epi8 ((char) ch), vnul = _mm256_setzero_si256 ();
+    while (end - ptr >= 32)
+    {
+        __m256i v = _mm256_loadu_si256 ((__m256i *) ptr);
+        uint32_t eq = _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, vch));
+        uint32_t in = eq | (uint32_t) _mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, vnul));
+        if (in != UINT32_MAX) // the run ends in this vector
+        {
+            int k = __builtin_ctz (~in);
+            *count = n + __builtin_popcount (eq & ((1u << k) - 1));
+            return ptr + k;
+        }
+        n += __builtin_popcount (eq);
+        ptr += 32;
+    }
+    uint64_t tail;
+    ptr = run_end_sse2 (ptr, end, ch, &tail);
+    *count = n + tail;
+    return ptr;
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt,bmi")))
+unsigned char *run_end_avx512 (unsigned char* ptr, unsigned char* end, unsigned char ch, uint64_t *count)
+{
+    uint64_t n = 0;
+    __m512i vch = _mm512_set1_epi8 ((char) ch), vnul = _mm512_setzero_si512 ();
+    while (end - ptr >= 64)
+    {
+        __m512i v = _mm512_loadu_si512 ((void *) ptr);
+        uint64_t eq = _mm512_cmpeq_epi8_mask (v, vch);
+        uint64_t in = eq | _mm512_cmpeq_epi8_mask (v, vnul);
+        if (in != UINT64_MAX) // the run ends in this vector
+        {
+            int k = __builtin_ctzll (~in);
+            *count = n + __builtin_popcountll (eq & ((1ull << k) - 1));
+            return ptr + k;
+        }
+        n += __builtin_popcountll (eq);
+        ptr += 64;
+    }
+    uint64_t tail;
+    ptr = run_end_avx2 (ptr, end, ch, &tail);
+    *count = n + tail;
+    return ptr;
+}
+#endif
+
+// kernels by name, best first; the first one the CPU supports is used unless -s picks one
+typedef struct __kernel_t {
+    const char *name;
+    run_kernel_t run_end;
+} kernel_t;
+
+kernel_t g_kernels[] = {
+#ifdef PZIP_X86
+    {"avx512", run_end_avx512},
+    {"avx2", run_end_avx2},
+    {"sse2", run_end_sse2},
+#endif
+    {"scalar", run_end_scalar},
+};
+int g_n_kernels = sizeof(g_kernels) / sizeof(g_kernels[0]);
+kernel_t *g_kernel;             // kernel used by the C threads
+
+// whether the CPU running pzip supports a kernel
+int kernel_supported (kernel_t *kernel)
+{
+#ifdef PZIP_X86
+    __builtin_cpu_init ();
+    if (strcmp (kernel->name, "avx512") == 0)
+        return __builtin_cpu_supports ("avx512f") && __builtin_cpu_supports ("avx512bw")
+               && __builtin_cpu_supports ("popcnt") && __builtin_cpu_supports ("bmi");
+    if (strcmp (kernel->name, "avx2") == 0)
+        return __builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("popcnt") && __builtin_cpu_supports ("bmi");
+    if (strcmp (kernel->name, "sse2") == 0)
+        return __builtin_cpu_supports ("sse2");
+#endif
+    return 1;
+}
+
+// compress the bytes [chunk_ptr, chunk_end) into a slot buffer, returns the new end of the slot contents
+char *compress_bytes (unsigned char* chunk_ptr, unsigned char* chunk_end, run_t *run, int slot, char* slot_ptr)
+{
+    unsigned char prev_ch = run->ch;
+    uint64_t count = run->count;
+    char* slot_end = g_buf->data[slot] + g_buf->size[slot];
+    run_kernel_t run_end = g_kernel->run_end;
+
+    // perform compression of chunk into slot buffer, one run at a time
+    while (chunk_ptr < chunk_end)
+    {
+        uint64_t n;
+        // initialize, the run starts at the next character that is not NUL
+        if (count == 0) 
+        {
+            if (*chunk_ptr == '\0')
             {
-                chunk_ptr++;
+                chunk_ptr = run_end (chunk_ptr, chunk_end, '\0', &n);
                 continue;
             }
+            prev_ch = *chunk_ptr;
+        }
+
+        // extend the run as far as the char repeats
+        chunk_ptr = run_end (chunk_ptr, chunk_end, prev_ch, &n);
+        count += n;
+        // counter full
+        while (count > UINT32_MAX)
+        {
+            slot_ptr = put_run (UINT32_MAX, prev_ch, run, slot, slot_ptr, &slot_end);
+            count -= UINT32_MAX;
+        }
+        // a different char ends the run
+        if (chunk_ptr < chunk_end)
+        {   
+            slot_ptr = put_run (count, prev_ch, run, slot, slot_ptr, &slot_end);
+            count = 0; // reinitialize
+        }
+    }
+    run->ch = prev_ch;
+    run->count = count;
+    return slot_ptr;
+}
+
+// write the last run of a chunk and record the length of the slot contents
+void finish_slot (run_t *run, int slot, char* slot_ptr)
+{
+    // last compressed unit hasn't been written to slotbuf
+    if (run->count > 0) 
+    {
+        char* slot_end = g_buf->data[slot] + g_buf->size[slot];
+        slot_ptr = put_run (run->count, run->ch, run, slot, slot_ptr, &slot_end);
+    }
+    g_buf->len[slot] = slot_ptr - g_buf->data[slot];
+    g_buf->raw_len[slot] = run->raw; // decoded length of the frame
+}
+
+// compress bytes [start, end) of the concatenated input into a slot buffer, runs continue across file boundaries
+void compress_range (uint64_t start, uint64_t end, int slot)
+{
+    run_t run = {.literal = -1};
+    char* slot_ptr = g_buf->data[slot];
+    for (int file = find_input (start); start < end; file++)
+    {
+        // part of the chunk that lies in this file
+        input_t *input = &g_inputs[file];
+        unsigned char* chunk_ptr = (unsigned char *) input->begin + (start - input->offset);
+        unsigned char* chunk_end = (unsigned char *) input->begin + (MIN (end, input->offset + input->size) - input->offset);
+        start = MIN (end, input->offset + input->size);
+        slot_ptr = compress_bytes (chunk_ptr, chunk_end, &run, slot, slot_ptr);
+    }
+    finish_slot (&run, slot, slot_ptr);
+}
+
+/* place the contents of a slot in the output after the chunks placed so far, fills at most 2 iovecs and returns how many
+legacy format: the last unit of the output so far (carry) is held back because the next chunk may continue its run;
+it is merged into the first unit of the slot in place, or written before it from head; the last unit of the slot
+becomes the new carry
+framed format: the slot is a frame, decoded without the chunks around it, written after its header from head
+(every codec but units is written in the framed format) */
+int place_slot (int slot, char* head, struct iovec *iov)
+{
+    char* slot_ptr = g_buf->data[slot];
+    uint64_t len = g_buf->len[slot];
+    int iovcnt = 0;
+    if (len == 0) // only NUL bytes
+        return 0;
+
+    if (g_framed)
+    {
+        // index entry of the frame
+        if (g_n_frames == g_index_size)
+        {
+            g_index_size = MAX (1024, 2 * g_index_size);
+            g_index = realloc (g_index, g_index_size * sizeof(index_entry_t));
+            assert (g_index != NULL);
+        }
+        index_entry_t *entry = &g_index[g_n_frames++];
+        entry->offset = g_placed;
+        entry->raw_offset = g_raw_placed;
+        entry->raw_length = g_buf->raw_len[slot];
+
+        frame_header_t frame = {entry->raw_offset, entry->raw_length, len};
+        memcpy (head, &frame, sizeof(frame));
+        iov[0] = (struct iovec) {head, sizeof(frame)};
+        iov[1] = (struct iovec) {slot_ptr, len};
+        g_placed += sizeof(frame) + len;
+        g_raw_placed += entry->raw_length;
+        return 2;
+    }
+
+    uint32_t curr_count = *(uint32_t *) slot_ptr; // first unit
+    unsigned char curr_ch = slot_ptr[sizeof (uint32_t)];
+    // write the unit held back if no longer a combination with the first unit of this slot
+    if (g_carry.count != 0 && curr_ch != g_carry.ch)
+    {
+        write_to_slotbuf (g_carry.count, g_carry.ch, head);
+        iov[iovcnt++] = (struct iovec) {head, UNIT_SIZE};
+    }
+    // still a combination of previous compression unit, merged in place
+    else if (g_carry.count != 0)
+    {
+        uint64_t temp_count = (uint64_t) g_carry.count + curr_count;
+        // overflow, cannot be represented in 32 bits
+        if (temp_count > UINT32_MAX) 
+        {
+            write_to_slotbuf (UINT32_MAX, g_carry.ch, head);
+            iov[iovcnt++] = (struct iovec) {head, UNIT_SIZE};
+            temp_count -= UINT32_MAX;
+        }
+        *(uint32_t *) slot_ptr = temp_count;
+    }
+
+    // every unit but the last one is written straight from the slot buffer
+    if (len > UNIT_SIZE)
+        iov[iovcnt++] = (struct iovec) {slot_ptr, len - UNIT_SIZE};
+    g_carry.count = *(uint32_t *) (slot_ptr + len - UNIT_SIZE);
+    g_carry.ch = slot_ptr[len - 1];
+    for (int i = 0; i < iovcnt; i++)
+        g_placed += iov[i].iov_len;
+    return iovcnt;
+}
+
+// write what comes before the first chunk at offset (at the file position if offset < 0): the framed format header
+void write_head (off_t offset)
+{
+    if (!g_framed)
+        return;
+    file_header_t header = {FRAME_MAGIC, g_codec->id};
+    struct iovec iov = {&header, sizeof(header)};
+    write_all (STDOUT_FILENO, &iov, 1, offset);
+    g_placed += sizeof(header);
+}
+
+// write what comes after the last chunk at offset (at the file position if offset < 0):
+// the unit held back, or the index and footer of the framed format
+void write_tail (off_t offset)
+{
+    if (g_framed)
+    {
+        file_footer_t footer = {g_placed, g_n_frames, INDEX_MAGIC};
+        struct iovec iov[2] = {{g_index, g_n_frames * sizeof(index_entry_t)}, {&footer, sizeof(footer)}};
+        write_all (STDOUT_FILENO, iov, 2, offset);
+        g_placed += iov[0].iov_len + iov[1].iov_len;
+        return;
+    }
+    if (g_carry.count != 0)
+    {
+        char last[UNIT_SIZE];
+        write_to_slotbuf (g_carry.count, g_carry.ch, last);
+        struct iovec iov = {last, UNIT_SIZE};
+        write_all (STDOUT_FILENO, &iov, 1, offset);
+        g_placed += UNIT_SIZE;
+    }
+}
+
+// pwrite mode: place a compressed chunk in the output after the previous one, then write it at its own offset
+void publish_slot (uint64_t chunk_index, int slot)
+{
+    char head[HEAD_SIZE];
+    struct iovec iov[2];
+
+    // wait for the previous chunk to be placed, chunks are placed in order
+    seq_wait (&g_buf->compressed[slot], chunk_index + 1, WAIT_CHUNK);
+    off_t offset = g_out_base + g_placed;
+    int iovcnt = place_slot (slot, head, iov);
+    // let the next chunk be placed, its offset is known now
+    seq_publish (&g_buf->compressed[(chunk_index + 1) % (g_buf->n_slots)], chunk_index + 2);
+
+    // written in parallel with the other chunks
+    write_all (STDOUT_FILENO, iov, iovcnt, offset);
+
+    /* free the slots of the chunks written so far in chunk order, as W does: a slot freed before the slots of
+    earlier chunks would let C claim a chunk whose slot is still in use; whoever sees the oldest unreleased chunk
+    written moves released past it, the thread writing that chunk stores its mark before looking at released
+    and the thread releasing the chunk before it looks at the mark after moving released (seq_cst), so one of
+    them moves released on */
+    __atomic_store_n (&g_buf->written[slot], (uint32_t) chunk_index + 1, __ATOMIC_SEQ_CST);
+    uint32_t next = __atomic_load_n (&g_buf->released.value, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n (&g_buf->written[next % g_buf->n_slots], __ATOMIC_SEQ_CST) == next + 1)
+        if (__atomic_compare_exchange_n (&g_buf->released.value, &next, next + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            seq_wake (&g_buf->released); // C can claim a new chunk
+            next++;
+        }
+}
+
+/*
+thread placement (-a): CPUs the process may run on, ordered from the topology in sysfs
+compact: fill the cores of one NUMA node (and socket) before the next, so C threads share caches and memory
+spread: one CPU per node in turn, and one hardware thread per core before the siblings, for memory bandwidth
+a CPU list (0-3,8): that order
+W (and R) take the first CPU on the NUMA node of the output device if sysfs knows it, the first one otherwise;
+C threads take the others in order
+*/
+typedef struct __cpu_t {
+    int id;                     // CPU number
+    int node;                   // NUMA node, 0 if unknown
+    int package;                // physical package (socket)
+    int core;                   // core in the package
+    int sibling;                // spread: hardware thread of the core, in order
+    int core_rank;              // spread: core in the node, in order
+} cpu_t;
+
+// integer in a sysfs file, fallback if it cannot be read
+int read_sysfs_int (const char *path, int fallback)
+{
+    FILE *fp = fopen (path, "r");
+    if (fp == NULL)
+        return fallback;
+    int value = fallback;
+    if (fscanf (fp, "%d", &value) != 1)
+        value = fallback;
+    fclose (fp);
+    return value;
+}
+
+// parse a CPU list such as 0-3,8 into cpus, returns the number of CPUs or -1 if malformed
+int parse_cpu_list (const char *list, int *cpus, int max)
+{
+    int n = 0;
+    while (*list != '\0' && *list != '\n')
+    {
+        char *end;
+        long first = strtol (list, &end, 10), last = first;
+        if (end == list || first < 0)
+            return -1;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol (list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        for (long cpu = first; cpu <= last && n < max; cpu++)
+            cpus[n++] = cpu;
+        list = (*end == ',') ? end + 1 : end;
+        if (*end != ',' && *end != '\0' && *end != '\n')
+            return -1;
+    }
+    return n;
+}
+
+int compare_compact (const void *a, const void *b)
+{
+    const cpu_t *x = a, *y = b;
+    if (x->node != y->node) return x->node - y->node;
+    if (x->package != y->package) return x->package - y->package;
+    if (x->core != y->core) return x->core - y->core;
+    return x->id - y->id;
+}
+
+int compare_spread (const void *a, const void *b)
+{
+    const cpu_t *x = a, *y = b;
+    if (x->sibling != y->sibling) return x->sibling - y->sibling;
+    if (x->core_rank != y->core_rank) return x->core_rank - y->core_rank;
+    if (x->node != y->node) return x->node - y->node;
+    return x->id - y->id;
+}
+
+// NUMA node of the device holding the output, -1 if unknown (pipes, terminals, devices sysfs does not place)
+int output_node ()
+{
+    struct stat out_stat;
+    if (fstat (STDOUT_FILENO, &out_stat) != 0)
+        return -1;
+    dev_t dev = S_ISBLK (out_stat.st_mode) ? out_stat.st_rdev : out_stat.st_dev;
+    if (!S_ISREG (out_stat.st_mode) && !S_ISBLK (out_stat.st_mode))
+        return -1;
+    char path[128];
+    snprintf (path, sizeof(path), "/sys/dev/block/%u:%u/device/numa_node", major (dev), minor (dev));
+    int node = read_sysfs_int (path, -1);
+    if (node < 0) // a partition, the device is its parent
+    {
+        snprintf (path, sizeof(path), "/sys/dev/block/%u:%u/../device/numa_node", major (dev), minor (dev));
+        node = read_sysfs_int (path, -1);
+    }
+    return node;
+}
+
+/* order the CPUs the threads are placed on for an -a argument, returns the number of CPUs (0 if mode is invalid);
+cpus[0] is the CPU of W and R */
+int place_threads (const char *mode, int *cpus, int max)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity (0, sizeof(allowed), &allowed) != 0)
+        return 0;
+    cpu_t list[CPU_SETSIZE];
+    int n = 0;
+
+    if (strcmp (mode, "compact") != 0 && strcmp (mode, "spread") != 0) // CPU list, kept in its order
+    {
+        int ids[CPU_SETSIZE];
+        int n_ids = parse_cpu_list (mode, ids, CPU_SETSIZE);
+        for (int i = 0; i < n_ids; i++)
+            if (ids[i] < CPU_SETSIZE && CPU_ISSET (ids[i], &allowed))
+                list[n++].id = ids[i];
+    }
+    else
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET (cpu, &allowed))
+                list[n++].id = cpu;
+    if (n == 0)
+        return 0;
+
+    // topology of every CPU
+    char path[128];
+    for (int i = 0; i < n; i++)
+    {
+        list[i].node = 0;
+        snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", list[i].id);
+        list[i].package = read_sysfs_int (path, 0);
+        snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", list[i].id);
+        list[i].core = read_sysfs_int (path, list[i].id);
+    }
+    DIR *nodes = opendir ("/sys/devices/system/node");
+    struct dirent *entry;
+    while (nodes != NULL && (entry = readdir (nodes)) != NULL)
+    {
+        int node;
+        if (sscanf (entry->d_name, "node%d", &node) != 1)
+            continue;
+        snprintf (path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *fp = fopen (path, "r");
+        char cpulist[4096];
+        int ids[CPU_SETSIZE];
+        int n_ids = (fp != NULL && fgets (cpulist, sizeof(cpulist), fp) != NULL)
+                    ? parse_cpu_list (cpulist, ids, CPU_SETSIZE) : 0;
+        if (fp != NULL)
+            fclose (fp);
+        for (int i = 0; i < n_ids; i++)
+            for (int j = 0; j < n; j++)
+                if (list[j].id == ids[i])
+                    list[j].node = node;
+    }
+    if (nodes != NULL)
+        closedir (nodes);
+
+    if (strcmp (mode, "compact") == 0 || strcmp (mode, "spread") == 0)
+        qsort (list, n, sizeof(cpu_t), compare_compact);
+    if (strcmp (mode, "spread") == 0)
+    {
+        // rank of every hardware thread in its core, and of its core in its node (cores are counted once, by
+        // their first hardware thread), in compact order
+        for (int i = 0; i < n; i++)
+        {
+            list[i].sibling = 0;
+            list[i].core_rank = 0;
+            for (int j = 0; j < i; j++)
+            {
+                if (list[j].node != list[i].node)
+                    continue;
+                if (list[j].package == list[i].package && list[j].core == list[i].core)
+                    list[i].sibling++;
+                else if (list[j].sibling == 0)
+                    list[i].core_rank++;
+            }
+        }
+        qsort (list, n, sizeof(cpu_t), compare_spread);
+    }
+
+    // W first: the first CPU on the node of the output device
+    int node = output_node ();
+    for (int i = 0; i < n && node >= 0; i++)
+        if (list[i].node == node)
+        {
+            cpu_t writer = list[i];
+            memmove (&list[1], &list[0], i * sizeof(cpu_t));
+            list[0] = writer;
+            break;
+        }
+    for (int i = 0; i < n && i < max; i++)
+        cpus[i] = list[i].id;
+    return MIN (n, max);
+}
+
+// pin the calling thread to a CPU (if cpu >= 0)
+void pin_thread (int cpu)
+{
+    if (cpu < 0)
+        return;
+    cpu_set_t set;
+    CPU_ZERO (&set);
+    CPU_SET (cpu, &set);
+    pthread_setaffinity_np (pthread_self (), sizeof(set), &set);
+}
+
+/*
+chunk size tuner (mapped input, no -b): C compresses a chunk while its input and its output stay in the core's
+L2 cache, and the chunks of all C threads fit in the shared L3; a chunk takes at least CHUNK_MIN_NS to compress,
+so handing it over costs little next to compressing it; then the input is cut into CHUNKS_PER_COMPRESSOR chunks
+per C thread at least, whatever the caches say (down to MIN_AUTO_CHUNK_SIZE); a sampling pass encodes
+SAMPLE_COUNT probes of the input to measure how many bytes the codec writes per input byte and how fast
+*/
+typedef struct __tune_t {
+    uint64_t l2;                // L2 cache size of a core
+    uint64_t l3;                // L3 cache size, shared by the C threads (0 if there is none)
+    double ratio;               // encoded bytes per input byte, sampled
+    double rate;                // input bytes compressed per ns by one thread, sampled
+} tune_t;
+
+tune_t g_tune;                  // what the tuner found, reported by -v
+
+// size of the level 2 or 3 cache of CPU 0, from sysconf or sysfs, 0 if unknown
+uint64_t cache_size (int level)
+{
+    long size = sysconf (level == 2 ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE);
+    if (size > 0)
+        return size;
+    for (int i = 0; ; i++)
+    {
+        char path[128];
+        snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        int index_level = read_sysfs_int (path, -1);
+        if (index_level < 0) // no more caches
+            return 0;
+        if (index_level != level)
+            continue;
+        snprintf (path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        FILE *fp = fopen (path, "r");
+        char value[32];
+        if (fp == NULL)
+            return 0;
+        size = (fscanf (fp, "%31s", value) == 1) ? parse_size (value) : 0; // 1024K
+        fclose (fp);
+        return size;
+    }
+}
+
+// encode [chunk_ptr, chunk_end) with the codec into a scratch buffer that is reused when full, returns the encoded size
+uint64_t sample_bytes (unsigned char* chunk_ptr, unsigned char* chunk_end)
+{
+    char scratch[16 * 1024];
+    char* ptr = scratch;
+    uint64_t encoded = 0;
+    run_t run = {.literal = -1};
+    while (chunk_ptr < chunk_end)
+    {
+        uint64_t n;
+        unsigned char ch = *chunk_ptr;
+        chunk_ptr = g_kernel->run_end (chunk_ptr, chunk_end, ch, &n);
+        if (ch == '\0') // NUL bytes are dropped
+            continue;
+        if (scratch + sizeof(scratch) - ptr < g_codec->max_run_size)
+        {
+            encoded += ptr - scratch;
+            ptr = scratch;
+            run.literal = -1;
+        }
+        ptr = g_codec->put_run (MIN (n, UINT32_MAX), ch, scratch, ptr, &run);
+    }
+    return encoded + (ptr - scratch);
+}
+
+// chunk size for input_size bytes of mapped input
+uint64_t tune_chunk_size (uint64_t input_size)
+{
+    g_tune.l2 = cache_size (2);
+    if (g_tune.l2 == 0)
+        g_tune.l2 = DEFAULT_L2_SIZE;
+    g_tune.l3 = cache_size (3);
+
+    // sampling pass: probes spread evenly over the input, each one within a file
+    uint64_t sampled = 0;
+    uint64_t encoded = 0;
+    uint64_t start = now_ns ();
+    for (int i = 0; i < SAMPLE_COUNT && input_size > 0; i++)
+    {
+        uint64_t pos = input_size / SAMPLE_COUNT * i;
+        input_t *input = &g_inputs[find_input (pos)];
+        unsigned char* probe = (unsigned char *) input->begin + (pos - input->offset);
+        uint64_t len = MIN (SAMPLE_SIZE, input->offset + input->size - pos);
+        encoded += sample_bytes (probe, probe + len);
+        sampled += len;
+    }
+    uint64_t elapsed = MAX (1, now_ns () - start);
+    g_tune.ratio = sampled ? (double) encoded / sampled : 1;
+    g_tune.rate = (double) sampled / elapsed;
+
+    // a chunk and its output in L2, the chunks of every C thread in L3
+    uint64_t chunk = g_tune.l2 / (1 + g_tune.ratio);
+    if (g_tune.l3 > 0)
+        chunk = MIN (chunk, g_tune.l3 / (g_compressors * (1 + g_tune.ratio)));
+    // long enough to compress
+    chunk = MAX (chunk, (uint64_t) (g_tune.rate * CHUNK_MIN_NS));
+    // several chunks per C thread
+    uint64_t balance_chunk = MAX (MIN_AUTO_CHUNK_SIZE, input_size / (CHUNKS_PER_COMPRESSOR * g_compressors) + 1);
+    return MAX (1, MIN (input_size, MIN (chunk, balance_chunk)));
+}
+
+// reader routine (streaming mode): reads the input files in fixed-size chunks into freed slots
+void *reader_routine (void *arg)
+{
+    pin_thread (*(int *) arg);
+    stats_start (g_compressors + 1);
+
+    int file = 0;
+    int fd = -1;
+    uint64_t chunk_index = 0;
+    while (1)
+    {
+        // corresponding mapped buffer slot
+        int slot = chunk_index % (g_buf->n_slots);
 
-            // read char
-            char curr_ch = *chunk_ptr;
-            chunk_ptr++;
+        // wait until this mapped buffer slot is free, slots are freed in chunk order
+        wait_slot (chunk_index);
 
-            // initialize
-            if (count == 0) 
+        // fill the chunk, pipes return less than asked for
+        uint64_t len = 0;
+        while (len < g_chunk_size)
+        {
+            if (fd < 0) // open the next file, files that cannot be opened are skipped
             {
-                prev_ch = curr_ch;
-                count = 1;
+                if (file == g_n_stream_files)
+                    break;
+                const char *name = g_stream_files[file++];
+                fd = (strcmp (name, "-") == 0) ? STDIN_FILENO : open (name, O_RDONLY);
+                continue;
             }
-            // count in range and char repeats
-            else if (count < UINT32_MAX && curr_ch == prev_ch)
-            {   
-                count += 1;   
+            uint64_t start = now_ns ();
+            ssize_t bytes = read (fd, g_buf->input[slot] + len, g_chunk_size - len);
+            g_read_ns += now_ns () - start;
+            if (t_stats != NULL)
+                t_stats->read_ns += now_ns () - start;
+            if (bytes < 0 && errno == EINTR)
+                continue;
+            if (bytes <= 0) // end of this file
+            {
+                if (fd != STDIN_FILENO)
+                    close (fd);
+                fd = -1;
+                continue;
             }
-            // counter full or a different char
-            else 
-            {   
-                write_to_slotbuf (count, prev_ch, slot_ptr);
-                slot_ptr += UNIT_SIZE; // 4 bytes for count, 1 byte for char
-                prev_ch = curr_ch;
-                count = 1; // reinitialize
+            len += bytes;
+        }
+        if (len == 0) // input exhausted
+            break;
+        g_buf->input_len[slot] = len;
+        g_buf->end[slot] = 0;
+        if (t_stats != NULL)
+        {
+            t_stats->chunks++;
+            t_stats->bytes_in += len;
+        }
+        seq_publish (&g_buf->filled[slot], chunk_index + 1);
+        chunk_index++;
+    }
+
+    /* every C thread ends up claiming one of the next g_compressors chunks, mark them as the end of the input;
+    the slots are reused after every chunk before them has been written, so waiting for them cannot block W */
+    for (int i = 0; i < g_compressors; i++)
+    {
+        int slot = (chunk_index + i) % (g_buf->n_slots);
+        wait_slot (chunk_index + i);
+        g_buf->end[slot] = 1;
+        seq_publish (&g_buf->filled[slot], chunk_index + i + 1);
+    }
+    stats_end ();
+    return 0;
+}
+
+// account for a chunk compressed into a slot since start
+void count_chunk (uint64_t start, uint64_t bytes, int slot)
+{
+    uint64_t elapsed = now_ns () - start;
+    __atomic_add_fetch (&g_compress_ns, elapsed, __ATOMIC_RELAXED);
+    if (t_stats != NULL)
+    {
+        t_stats->compress_ns += elapsed;
+        t_stats->chunks++;
+        t_stats->bytes_in += bytes;
+        t_stats->bytes_out += g_buf->len[slot];
+    }
+}
+
+// compressor routine
+void *compressor_routine (void *arg)
+{
+    // unpack arguments
+    C_arg_t compressor = *(C_arg_t *) arg;
+    int id = compressor.id;
+
+    pin_thread (compressor.cpu);
+    stats_start (id);
+
+    while (1)
+    {
+        /* claim the next chunk, then wait until its slot is free; the chunks before it have been claimed already,
+        so their slots are freed whatever this thread does (R waits for free slots in streaming mode) */
+        uint64_t chunk_index = __atomic_fetch_add (&g_next_chunk, 1, __ATOMIC_RELAXED);
+        if (chunk_index >= g_n_chunks) // all chunks claimed
+            break;
+        if (!g_streaming)
+            wait_slot (chunk_index);
+
+        // corresponding mapped buffer slot
+        int slot = chunk_index % (g_buf->n_slots); 
+        if (g_buf->data[slot] == NULL) // first use
+            alloc_slot (slot);
+        
+        if (g_streaming)
+        {
+            // wait until R has read the chunk into this slot
+            seq_wait (&g_buf->filled[slot], chunk_index + 1, WAIT_CHUNK);
+            if (g_buf->end[slot]) // no more chunks, let W see the end of the input
+            {
+                seq_publish (&g_buf->compressed[slot], chunk_index + 1);
+                break;
             }
+            uint64_t start = now_ns ();
+            run_t run = {.literal = -1};
+            unsigned char *chunk_ptr = (unsigned char *) g_buf->input[slot];
+            char *slot_ptr = compress_bytes (chunk_ptr, chunk_ptr + g_buf->input_len[slot], &run, slot, g_buf->data[slot]);
+            finish_slot (&run, slot, slot_ptr);
+            count_chunk (start, g_buf->input_len[slot], slot);
+            seq_publish (&g_buf->compressed[slot], chunk_index + 1);
+            continue;
         }
 
-        // last compressed unit hasn't been written to slotbuf
-        if (count > 0) 
+        // slot is free, begin compression
+        uint64_t chunk_start = chunk_index * g_chunk_size; // chunk position in the concatenated input
+        uint64_t chunk_end = MIN (chunk_start + g_chunk_size, g_input_size);
+        uint64_t start = now_ns ();
+        compress_range (chunk_start, chunk_end, slot);
+        count_chunk (start, chunk_end - chunk_start, slot);
+
+        // no W thread, write the chunk out directly
+        if (g_pwrite)
         {
-            write_to_slotbuf (count, prev_ch, slot_ptr);
-            slot_ptr += UNIT_SIZE;
+            publish_slot (chunk_index, slot);
+            continue;
         }
-        /* if slot is not full, write a (0,0) pair signaling the EOF
-        slot will be full only if there are no adjacent repeating character, worst case scenario */
-        if (slot_ptr < slot_end)
-            write_to_slotbuf (0, 0, slot_ptr);
 
         // signal W to start writing if it was waiting, definitely be the case in the first pass.
-        sem_post (&g_buf->compressed[slot]);
-        
-        // go to the next chunk if the current C is still running
-        chunk_ptr += (g_compressors - 1) * g_chunk_size;
-        chunck_index += g_compressors; 
+        seq_publish (&g_buf->compressed[slot], chunk_index + 1);
     }
+    stats_end ();
     return 0;
 }
 
 // writer routine
+// slots are written out whole with writev(), as many already compressed slots as possible per call (see place_slot)
 void *writer_routine(void *arg)
 {
-    // open file, stdout by default, can be changed using shell redirection
-    FILE *fpout = stdout;
-    assert(fpout != NULL);
+    pin_thread (*(int *) arg);
+    stats_start (g_compressors);
+
+    // output, stdout by default, can be changed using shell redirection
+    int fd = STDOUT_FILENO;
 
     // transfer data from slot buffer to output
-    int chunk_index = 0;
-    int prev_count = 0;
-    unsigned char prev_ch;
+    write_head (-1);
+    uint64_t chunk_index = 0;
+    struct iovec iov[2 * WRITE_BATCH];
+    char heads[WRITE_BATCH][HEAD_SIZE]; // written before the contents of each slot of a batch
+    int end = 0;
 
-    while (chunk_index < g_n_chunks)
+    while (chunk_index < g_n_chunks && !end)
     {
-        // corresponding mapped buffer slot
-        int slot = chunk_index % (g_buf->n_slots); 
-
-        // wait until the compression to this slot is done
-        sem_wait (&g_buf->compressed[slot]);
-
-        // slot is free, begin writing
-        char* slot_ptr = g_buf->data[slot]; // current pos in slot currently at the beginning
-        char* slot_end = slot_ptr + g_bytes_per_slot;  // ending address of slot
-
-        while (slot_ptr < slot_end)
+        int batch = 0;
+        int iovcnt = 0;
+        uint64_t placed = g_placed; // bytes of the output before the batch
+        while (batch < WRITE_BATCH && chunk_index + batch < g_n_chunks)
         {
-            uint32_t curr_count = *(uint32_t *) slot_ptr; // read count
-            slot_ptr += sizeof (uint32_t);
-            char curr_ch = *slot_ptr; // read char
-            slot_ptr++;
+            // corresponding mapped buffer slot
+            int slot = (chunk_index + batch) % (g_buf->n_slots); 
 
-            // initialize
-            if (prev_count == 0)
-            {
-                prev_count = curr_count;
-                prev_ch = curr_ch;
-            }
-            // early exit case, EOF
-            else if (curr_count == 0)
+            // wait until the compression to the first slot is done, add the next ones if they are done already
+            if (batch == 0)
+                seq_wait (&g_buf->compressed[slot], chunk_index + 1, WAIT_CHUNK);
+            else if (!seq_reached (&g_buf->compressed[slot], chunk_index + batch + 1))
                 break;
-            // write to output if no longer a combination of previous compression unit
-            else if (curr_ch != prev_ch)
-            {
-                write_out (prev_count, prev_ch, fpout);
-                prev_count = curr_count;
-                prev_ch = curr_ch;
-            }
-            // still a combination of previous compression unit
-            else
+            if (g_streaming && g_buf->end[slot]) // end of the input
             {
-                uint64_t temp_count = prev_count + curr_count;
-                // overflow, cannot be represented in 32 bits
-                if (temp_count > UINT32_MAX) 
-                {
-                    write_out (UINT32_MAX, prev_ch, fpout);
-                    prev_count = temp_count - UINT32_MAX;
-                }
-                // still a combination but no overflow!
-                else 
-                {   
-                    // update count
-                    prev_count = prev_count + curr_count;
-                }
+                end = 1;
+                break;
             }
+            iovcnt += place_slot (slot, heads[batch], iov + iovcnt);
+            batch++;
         }
 
-        // signal C to start compressing if it was waiting, slot is free not
-        sem_post (&g_buf->freed[slot]);  
-        // move on to next chunk (writing the corresponding slot)
-        chunk_index++;
-    }
+        write_all (fd, iov, iovcnt, -1); // shrinks the iovecs on partial writes, the batch size is counted from g_placed
+        if (t_stats != NULL)
+        {
+            t_stats->chunks += batch;
+            t_stats->bytes_out += g_placed - placed;
+        }
 
-    // write out the very last unit
-    if (prev_count != 0)
-        write_out (prev_count, prev_ch, fpout);
-    
-    // close output
-    int rc = fclose (fpout);
-    assert (rc == 0);
+        // signal C to start compressing if it was waiting, the slots of the batch are free now
+        seq_publish (&g_buf->released, chunk_index + batch);
+        // move on to next chunks (writing the corresponding slots)
+        chunk_index += batch;
+    }
 
+    // write out the very last unit, or the index
+    write_tail (-1);
+    stats_end ();
     return 0;
 }
 
 // perform parallel compression
+/* --stats report: one line per thread, then where the C threads and W spent their time
+wait_slot is the time blocked on a free slot, wait_chunk on a chunk (W), on the input (C streaming) or on the turn to
+place a chunk (C pwrite); C threads waiting on slots want more slots (SLOTS_PER_CPU, -m) or a faster output, W
+waiting on chunks wants more C threads, stalls much above chunks / slots mean the chunks are too small */
+void print_stats (uint64_t wall_ns)
+{
+    fprintf (stderr, "%-6s %6s %11s %9s %9s %12s %13s %7s %7s %12s %12s %10s\n", "thread", "util%", "compress_ms",
+             "read_ms", "write_ms", "wait_slot_ms", "wait_chunk_ms", "stalls", "chunks", "bytes_in", "bytes_out", "runs");
+    stats_t c_total = {0};
+    for (int i = 0; i < g_compressors + 2; i++)
+    {
+        stats_t *st = &g_stats[i];
+        if (st->start_ns == 0) // W in pwrite mode, R unless streaming
+            continue;
+        char name[16];
+        if (i < g_compressors)
+            snprintf (name, sizeof(name), "C%d", i);
+        else
+            snprintf (name, sizeof(name), "%s", i == g_compressors ? "W" : "R");
+        uint64_t busy = st->compress_ns + st->read_ns + st->write_ns;
+        uint64_t life = st->end_ns - st->start_ns;
+        fprintf (stderr, "%-6s %6.1f %11.1f %9.1f %9.1f %12.1f %13.1f %7llu %7llu %12llu %12llu %10llu\n", name,
+                 life ? 100.0 * busy / life : 0.0, st->compress_ns / 1e6, st->read_ns / 1e6, st->write_ns / 1e6,
+                 st->wait_slot_ns / 1e6, st->wait_chunk_ns / 1e6, (unsigned long long) st->stalls,
+                 (unsigned long long) st->chunks, (unsigned long long) st->bytes_in,
+                 (unsigned long long) st->bytes_out, (unsigned long long) st->runs);
+        if (i < g_compressors)
+        {
+            c_total.compress_ns += st->compress_ns;
+            c_total.write_ns += st->write_ns;
+            c_total.wait_slot_ns += st->wait_slot_ns;
+            c_total.wait_chunk_ns += st->wait_chunk_ns;
+            c_total.stalls += st->stalls;
+            c_total.chunks += st->chunks;
+        }
+    }
+    double c_time = (double) wall_ns * g_compressors;
+    stats_t *w = &g_stats[g_compressors];
+    fprintf (stderr, "pzip: wall_ms=%.1f chunks=%llu slots=%d chunk_size=%llu c_compress=%.1f%% c_write=%.1f%%"
+             " c_wait_slot=%.1f%% c_wait_chunk=%.1f%% c_stalls=%llu w_wait_chunk=%.1f%%\n",
+             wall_ns / 1e6, (unsigned long long) c_total.chunks, g_buf->n_slots, (unsigned long long) g_chunk_size,
+             100.0 * c_total.compress_ns / c_time, 100.0 * c_total.write_ns / c_time,
+             100.0 * c_total.wait_slot_ns / c_time, 100.0 * c_total.wait_chunk_ns / c_time,
+             (unsigned long long) c_total.stalls, 100.0 * w->wait_chunk_ns / wall_ns);
+}
+
 int main (int argc, const char* argv[])
 {
     // used for various return codes
     int rc = -1;
 
-    // must take atleast one input file as argument
-    if (argc < 2)
+    // options
+    int opt;
+    int verbose = 0;
+    int stats = 0;
+    int use_writer = 0;
+    g_memory_budget = MEMORY_BUDGET;
+    const char *kernel_name = NULL;
+    g_codec = &g_codecs[0];
+    int n_threads = 0;          // number of C threads, one less than the CPU cores by default
+    uint64_t chunk_size = 0;    // chosen from the input size, the cores and the budget by default
+    const char *affinity = NULL; // threads are not pinned by default
+    static const struct option long_options[] = {
+        {"stats", no_argument, NULL, 'S'},
+        {0, 0, 0, 0}
+    };
+    while ((opt = getopt_long (argc, (char * const *) argv, "a:b:c:fm:s:t:vw", long_options, NULL)) != -1)
     {
-        printf("pzip: file1 [file2 ...]\n");
+        char *end;
+        switch (opt)
+        {
+            case 'S': // report the time every thread spent working and blocked on STDERR
+                stats = 1;
+                break;
+            case 's': // run detection kernel: avx512, avx2, sse2 or scalar
+                kernel_name = optarg;
+                break;
+            case 'm': // memory budget of the slot pool in MiB
+                g_memory_budget = parse_number (optarg, &end);
+                if (g_memory_budget == 0 || *end != '\0' || g_memory_budget > (UINT64_MAX >> 20))
+                    usage ();
+                g_memory_budget <<= 20;
+                break;
+            case 'v': // report the slot pool footprint on STDERR
+                verbose = 1;
+                break;
+            case 'w': // always write the output with the W thread, even to a regular file
+                use_writer = 1;
+                break;
+            case 'f': // framed format, seekable
+                g_framed = 1;
+                break;
+            case 'c': // codec: units or varint
+                g_codec = NULL;
+                for (int i = 0; i < g_n_codecs && g_codec == NULL; i++)
+                    if (strcmp (optarg, g_codecs[i].name) == 0)
+                        g_codec = &g_codecs[i];
+                if (g_codec == NULL)
+                {
+                    fprintf (stderr, "pzip: unknown codec %s\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 't': // number of compressor threads
+                if ((n_threads = (int) MIN (parse_number (optarg, &end), INT_MAX)) == 0 || *end != '\0')
+                    usage ();
+                break;
+            case 'b': // chunk size in bytes, K, M or G suffix
+                if ((chunk_size = parse_size (optarg)) == 0)
+                    usage ();
+                break;
+            case 'a': // thread placement: compact, spread or a CPU list
+                affinity = optarg;
+                break;
+            default:
+                usage ();
+        }
+    }
+    // only units can be merged across chunks in a flat stream, other codecs need the header of the framed format
+    if (g_codec->id != CODEC_UNITS)
+        g_framed = 1;
+
+    // pick the run detection kernel, the best one the CPU supports by default
+    g_kernel = NULL;
+    for (int i = 0; i < g_n_kernels && g_kernel == NULL; i++)
+        if (kernel_name == NULL ? kernel_supported (&g_kernels[i]) : strcmp (kernel_name, g_kernels[i].name) == 0)
+            g_kernel = &g_kernels[i];
+    if (g_kernel == NULL || !kernel_supported (g_kernel))
+    {
+        fprintf (stderr, "pzip: kernel %s is not supported\n", kernel_name);
         exit(1);
     }
 
-    uint64_t map_size = 0;
-    // open the files
-    for (int i = 1; i < argc; i++) 
+    // thread placement: W and R on cpus[0], C threads on the next CPUs (wrapping around), nothing pinned without -a;
+    // checked before anything is written to the output
+    int cpus[CPU_SETSIZE];
+    int n_cpus = 0;
+    if (affinity != NULL)
     {
-        // for each file get size
+        n_cpus = place_threads (affinity, cpus, CPU_SETSIZE);
+        if (n_cpus == 0)
+        {
+            fprintf (stderr, "pzip: invalid affinity %s\n", affinity);
+            exit(1);
+        }
+    }
+    int io_cpu = (n_cpus > 0) ? cpus[0] : -1;
+
+    // file arguments
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // must take atleast one input file as argument, or read STDIN when it is not a terminal
+    if (argc < 2 && isatty (STDIN_FILENO))
+        usage ();
+
+    /* STDIN ("-", or no argument) and files that are not regular files (pipes, devices) cannot be mapped,
+    they are read in fixed-size chunks by the R thread instead, so memory use does not depend on the input size */
+    g_streaming = (argc < 2);
+    for (int i = 1; i < argc && !g_streaming; i++)
+    {
+        struct stat stat_buf;
+        g_streaming = (strcmp (argv[i], "-") == 0 || (stat (argv[i], &stat_buf) == 0 && !S_ISREG (stat_buf.st_mode)));
+    }
+    static const char *stdin_name = "-";
+    g_stream_files = (argc < 2) ? &stdin_name : argv + 1;
+    g_n_stream_files = (argc < 2) ? 1 : argc - 1;
+
+    // map every input file read-only, chunks are compressed straight from the page cache
+    uint64_t map_start = now_ns ();
+    g_inputs = malloc (argc * sizeof(input_t));
+    assert (g_inputs != NULL);
+    g_n_inputs = 0;
+    g_input_size = 0;
+    for (int i = 1; i < argc && !g_streaming; i++) 
+    {
+        // files that cannot be opened are skipped
         int fd = open(argv[i], O_RDONLY);
         if (fd < 0)
             continue;   
-        // get total size
-        map_size += get_file_size (fd);
+        uint64_t size = get_file_size (fd);
+        if (size == 0) // nothing to map
+        {
+            close(fd);
+            continue;
+        }
+        input_t *input = &g_inputs[g_n_inputs++];
+        input->begin = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        assert (input->begin != MAP_FAILED);
         close(fd);
+        // compressors read every file front to back
+        rc = madvise(input->begin, size, MADV_SEQUENTIAL);
+        assert (rc == 0);
+        input->size = size;
+        input->offset = g_input_size;
+        g_input_size += size;
     }
+    uint64_t map_size = g_input_size;
+    g_read_ns += now_ns () - map_start;
 
-    fpout = stdout; // by default outputs to stdout, can be changed using shell redirection
-    assert (fpout != NULL);
 
-    // create a memory map
-    int fd = open("/dev/zero", O_RDWR);
-    g_map_begin = mmap(0, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    close(fd);
-	//g_map_begin = mmap (NULL, map_size, PROT_READ | PROT_WRITE, MAP_ANON, -1, 0);
-    assert (g_map_begin != MAP_FAILED);
-    // map the file contents into mmap
-    g_map_end = g_map_begin;
-    for (int i = 1; i < argc; i++) 
-    {
-        FILE *f = fopen (argv[i], "rb");
-        if (f == NULL)
-            continue; 
-        fseek(f, 0, SEEK_END);
-        uint64_t bytes = ftell(f);
-        fseek(f, 0, SEEK_SET);
-
-        rc = (int) fread(g_map_end, (uint64_t) bytes, 1, f);
-        g_map_end += bytes;
+    // number of CPU cores
+    int cpu_cores = get_nprocs(); // number of processors available in the system
+    assert (cpu_cores > 0); // must have atleast 1 available processor
+    g_compressors = cpu_cores > 1? cpu_cores - 1: 1; // guard against single-core edge case
+    if (n_threads > 0)
+        g_compressors = n_threads;
 
-        fclose(f);
-    }
-    
-    uint64_t MAX_CHUNK_SIZE;
-
-    if (map_size < 15 * 1024 * 1024)
-        MAX_CHUNK_SIZE = 4 * 1024 * 1024;
-    else if (map_size < 1.5 * 1024 * 1024 * 1024)
-        MAX_CHUNK_SIZE = 400 * 1024 * 1024;
-    else if (map_size < 2.5 * 1024 * 1024 * 1024)
-        MAX_CHUNK_SIZE = 800 * 1024 * 1024;
+    // partition input file into chunks: -b, or sized by the tuner from the caches, the cores and a sample of the input
+    if (chunk_size > 0)
+        g_chunk_size = chunk_size;
+    else if (g_streaming) // the number of chunks is found out by R
+        g_chunk_size = STREAM_CHUNK_SIZE;
     else
-        MAX_CHUNK_SIZE = 1.9 * 1024 * 1024 * 1024;
-
-    // partition input file into chunks
-    g_chunk_size = MIN (map_size, MAX_CHUNK_SIZE); // handling case when file size can be smaller than chosen chunk size
-    g_n_chunks = (uint64_t) ceil (map_size * 1.0 / g_chunk_size);
-    g_bytes_per_slot = g_chunk_size * UNIT_SIZE;
+        g_chunk_size = tune_chunk_size (map_size);
 
     // create a circular buffer
     g_buf = malloc (sizeof(buf_t));
     assert (g_buf != NULL);
     
-    // number of CPU cores
-    int cpu_cores = get_nprocs(); // number of processors available in the system
-    assert (cpu_cores > 0); // must have atleast 1 available processor
-
-    // number of slots
-    g_buf->n_slots = SLOTS_PER_CPU * (cpu_cores - 1); // 1 core reserved for writer(W)
+    /* number of slots and chunk size, capped by the memory budget: slot buffers grow on demand, but even if every
+    one of them grows to the worst case (5 bytes per input byte with units, plus the input buffer when streaming) the pool
+    stays within the budget; chunks are made smaller to keep SLOTS_PER_CPU slots per C thread, but not below
+    MIN_CHUNK_SIZE unless that is the only way to fit the 2 slots per C thread that are always kept; a -b chunk size
+    whose 2 slots per C thread do not fit is rejected */
+    uint64_t worst_per_byte = g_codec->worst_per_byte + (g_streaming ? 1 : 0);
+    uint64_t budget_chunk = g_memory_budget / (SLOTS_PER_CPU * g_compressors * worst_per_byte);
+    uint64_t min_budget_chunk = g_memory_budget / (2 * g_compressors);
+    min_budget_chunk = (min_budget_chunk > g_codec->max_run_size) ?
+                       (min_budget_chunk - g_codec->max_run_size) / worst_per_byte : 0;
+    if (chunk_size == 0)
+        g_chunk_size = MAX (1, MIN (MIN (g_chunk_size, MAX (budget_chunk, MIN_CHUNK_SIZE)), min_budget_chunk));
+    g_n_chunks = g_streaming ? UINT64_MAX : (uint64_t) ceil (map_size * 1.0 / g_chunk_size);
+    g_bytes_per_slot = g_chunk_size * g_codec->worst_per_byte + g_codec->max_run_size;
+    uint64_t budget_slots = g_memory_budget / (g_bytes_per_slot + (g_streaming ? g_chunk_size : 0));
+    if (budget_slots < 2 * g_compressors)
+    {
+        fprintf (stderr, "pzip: %d slots of %llu bytes do not fit in the memory budget of %llu MiB (-m)\n",
+                 2 * g_compressors, (unsigned long long) g_chunk_size,
+                 (unsigned long long) (g_memory_budget / (1024 * 1024)));
+        exit(1);
+    }
+    g_buf->n_slots = MIN (SLOTS_PER_CPU * g_compressors, budget_slots); // 1 core reserved for writer(W)
 
     // reserving space for the internal data buffers, a buffer for each slot
     g_buf->data = malloc (g_buf->n_slots * sizeof(char*)); // array of pointers to slot memory
+    g_buf->size = malloc (g_buf->n_slots * sizeof(uint64_t));
+    g_buf->len = calloc (g_buf->n_slots, sizeof(uint64_t));
+    g_buf->raw_len = calloc (g_buf->n_slots, sizeof(uint64_t));
+    assert (g_buf->data != NULL && g_buf->size != NULL && g_buf->len != NULL && g_buf->raw_len != NULL);
     for(int i = 0; i < g_buf->n_slots; i++)
     {   
-        g_buf->data[i] = malloc(g_bytes_per_slot); // slot memory
-        assert (g_buf->data[i] != NULL);
+        g_buf->data[i] = NULL; // allocated by the first C thread using the slot
+        g_buf->size[i] = 0;
     }
 
-    // reserving space for compressed semaphores array
-    g_buf->compressed = malloc(g_buf->n_slots * sizeof(sem_t));
+    // handoff ring: nothing compressed yet, no slot released (every slot is free for the first n_slots chunks)
+    g_buf->compressed = calloc (g_buf->n_slots, sizeof(seq_t));
     assert (g_buf->compressed != NULL);
-    // reserving space for freed semaphores array
-    g_buf->freed = malloc(g_buf->n_slots * sizeof(sem_t));
-    assert (g_buf->freed != NULL);
+    g_buf->released = (seq_t) {0, 0};
+    g_spin_max = (cpu_cores > 1) ? SPIN_MAX : 0;
 
-    // initialize semaphores
-    for(int i = 0; i < g_buf->n_slots; i++)
+    // streaming mode: input buffers filled by R
+    if (g_streaming)
     {
-        rc = sem_init(&g_buf->compressed[i], 0, 0); // value = 0 implies fork-join
-        rc |= sem_init(&g_buf->freed[i], 0, 1); // value = 1 implies mutex
-        assert (rc == 0);
+        g_buf->input = malloc (g_buf->n_slots * sizeof(char*));
+        g_buf->input_len = malloc (g_buf->n_slots * sizeof(uint64_t));
+        g_buf->end = calloc (g_buf->n_slots, sizeof(int));
+        g_buf->filled = calloc (g_buf->n_slots, sizeof(seq_t));
+        assert (g_buf->input != NULL && g_buf->input_len != NULL && g_buf->end != NULL && g_buf->filled != NULL);
+        for (int i = 0; i < g_buf->n_slots; i++)
+        {
+            g_buf->input[i] = malloc (g_chunk_size);
+            assert (g_buf->input[i] != NULL);
+            pool_add (g_chunk_size);
+        }
+    }
+
+    /* pwrite mode: when the output is a regular file (not opened for appending), the C threads write their chunks
+    at their own offset from the current file position, chunks are placed in order by passing a turn through the
+    compressed sequence words, starting at chunk 0; streamed chunks keep going through W */
+    struct stat out_stat;
+    g_pwrite = !use_writer && !g_streaming && fstat (STDOUT_FILENO, &out_stat) == 0 && S_ISREG (out_stat.st_mode)
+               && !(fcntl (STDOUT_FILENO, F_GETFL) & O_APPEND);
+    g_out_base = g_pwrite ? lseek (STDOUT_FILENO, 0, SEEK_CUR) : -1;
+    g_pwrite = g_pwrite && g_out_base >= 0;
+    if (g_pwrite)
+    {
+        write_head (g_out_base);
+        seq_publish (&g_buf->compressed[0], 1);
+        g_buf->written = calloc (g_buf->n_slots, sizeof(uint32_t));
+        assert (g_buf->written != NULL);
+    }
+
+    // --stats: counters of the C threads, W and R
+    uint64_t start_ns = now_ns ();
+    if (stats)
+    {
+        g_stats = calloc (g_compressors + 2, sizeof(stats_t));
+        assert (g_stats != NULL);
     }
 
     // create N compressor(C) threads
-    g_compressors = cpu_cores > 1? cpu_cores - 1: 1; // guard against single-core edge case
     pthread_t c_threads[g_compressors];
     C_arg_t cargs[g_compressors];
     for (int i = 0; i < g_compressors; i++)
     {
         cargs[i].id = i;
+        cargs[i].cpu = (n_cpus == 0) ? -1 : (n_cpus == 1) ? cpus[0] : cpus[1 + i % (n_cpus - 1)];
         rc = pthread_create(&c_threads[i], NULL, compressor_routine, &cargs[i]);
         assert (rc == 0);
     }
 
     // create one writer(W) thread
     pthread_t w_thread;
-    rc = pthread_create (&w_thread, NULL, writer_routine, NULL);
-    assert (rc == 0);
+    if (!g_pwrite)
+    {
+        rc = pthread_create (&w_thread, NULL, writer_routine, &io_cpu);
+        assert (rc == 0);
+    }
 
-    // main should wait for W to finish
-    pthread_join (w_thread, (void **) &rc);
+    // create the reader(R) thread in streaming mode
+    pthread_t r_thread;
+    if (g_streaming)
+    {
+        rc = pthread_create (&r_thread, NULL, reader_routine, &io_cpu);
+        assert (rc == 0);
+    }
+
+    // main should wait for W (or C in pwrite mode) to finish
+    for (int i = 0; i < g_compressors; i++)
+        pthread_join (c_threads[i], NULL);
+    if (!g_pwrite)
+        pthread_join (w_thread, NULL);
+    if (g_streaming)
+        pthread_join (r_thread, NULL);
 
-    // un-mmap the file
-    rc = munmap (g_map_begin, map_size); 
-    assert (rc == 0); 
+    // pwrite mode: write out the very last unit (or the index) and leave the file position after the output
+    if (g_pwrite)
+    {
+        write_tail (g_out_base + g_placed);
+        rc = (lseek (STDOUT_FILENO, g_out_base + g_placed, SEEK_SET) < 0);
+        assert (rc == 0);
+    }
+
+    // un-mmap the files
+    for (int i = 0; i < g_n_inputs; i++)
+    {
+        rc = munmap (g_inputs[i].begin, g_inputs[i].size); 
+        assert (rc == 0); 
+    }
+    free (g_inputs);
     
+    // report the footprint of the slot pool and the time spent in every stage
+    if (verbose)
+    {
+        struct rusage usage;
+        getrusage (RUSAGE_SELF, &usage);
+        fprintf (stderr, "pzip: kernel=%s codec=%s output=%s affinity=%s threads=%d slots=%d chunk_size=%llu budget=%llu peak_buffers=%llu maxrss_kb=%ld"
+                 " read_ms=%.1f compress_ms=%.1f write_ms=%.1f l2=%llu l3=%llu sample_ratio=%.3f sample_mb_s=%.0f\n",
+                 g_kernel->name, g_codec->name, g_pwrite ? "pwrite" : "writer", affinity ? affinity : "none", g_compressors, g_buf->n_slots, (unsigned long long) g_chunk_size, (unsigned long long) g_memory_budget,
+                 (unsigned long long) g_pool_peak, usage.ru_maxrss, g_read_ns / 1e6, g_compress_ns / 1e6, g_write_ns / 1e6,
+                 (unsigned long long) g_tune.l2, (unsigned long long) g_tune.l3, g_tune.ratio, g_tune.rate * 1e3);
+    }
+
+    if (stats)
+    {
+        print_stats (now_ns () - start_ns);
+        free (g_stats);
+    }
+
     // free up slot data buffers
     for (int i = 0; i < g_buf->n_slots; i++)
         free (g_buf->data[i]);
     free (g_buf->data);
+    free (g_buf->size);
+    free (g_buf->len);
+    free (g_buf->raw_len);
+    free (g_index);
 
-    // free up semaphores
+    // free up the handoff ring
     free (g_buf->compressed);
-    free (g_buf->freed);
+    if (g_pwrite)
+        free (g_buf->written);
+
+    // free up input buffers
+    if (g_streaming)
+    {
+        for (int i = 0; i < g_buf->n_slots; i++)
+            free (g_buf->input[i]);
+        free (g_buf->input);
+        free (g_buf->input_len);
+        free (g_buf->end);
+        free (g_buf->filled);
+    }
 
     // free up slot
     free (g_buf);
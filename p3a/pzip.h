@@ -0,0 +1,58 @@
+#ifndef PZIP_H
+#define PZIP_H
+
+#include <stdint.h>         // portable int type
+
+/*
+output formats shared by pzip and punzip
+legacy (default): a flat stream of 5-byte units (4 bytes count + 1 byte char), runs merged across chunks
+framed (pzip -f): a seekable container, every chunk is a frame decoded on its own
+    file header | frame header, payload | frame header, payload | ... | index entry | index entry | ... | footer
+    the footer, at the very end, locates the index; the index entry of a frame gives its position in the container
+    and the decoded bytes it holds, so any byte range is decoded by reading the footer, the index and the frames
+    overlapping the range; decoded offsets count output bytes (pzip drops NUL bytes)
+every field is stored in the byte order of the machine, little-endian on x86
+codecs (payload of a frame; the legacy format is always units):
+units: 5-byte units, one per run
+varint: a stream of tokens, each starting with a LEB128 varint v (7 bits per byte, low bits first, high bit set on
+    every byte but the last); v even: a run of v >> 1 times the byte that follows; v odd: a literal, the next
+    (v >> 1) + 1 bytes are copied as they are; runs shorter than VARINT_MIN_RUN are put in literals, whose 1-byte
+    header is extended in place up to VARINT_LITERAL_FULL (64 bytes); a concatenation of payloads is a valid payload
+*/
+
+#define UNIT_SIZE 5                         // size of each compressed unit is 5 bytes (4 bytes integer + 1 byte char) in binary
+#define FRAME_MAGIC "PZFRAME"               // start of a framed file (8 bytes with the NUL)
+#define INDEX_MAGIC "PZINDEX"               // end of a framed file (8 bytes with the NUL)
+#define CODEC_UNITS 0                       // payloads are 5-byte units
+#define CODEC_VARINT 1                      // payloads are varint-RLE tokens
+#define VARINT_MIN_RUN 3                    // shorter runs are copied into literals
+#define VARINT_LITERAL_FULL ((63 << 1) | 1) // header of a literal of 64 bytes, the longest one
+
+// start of a framed file
+typedef struct __file_header_t {
+    char magic[8];              // FRAME_MAGIC
+    uint64_t codec;             // encoding of every payload
+} file_header_t;
+
+// start of a frame, followed by its payload
+typedef struct __frame_header_t {
+    uint64_t raw_offset;        // decoded offset of the first byte of the frame
+    uint64_t raw_length;        // decoded bytes of the frame
+    uint64_t payload_size;      // bytes of payload following the header
+} frame_header_t;
+
+// one per frame, in order, after the last frame
+typedef struct __index_entry_t {
+    uint64_t offset;            // position of the frame header in the container
+    uint64_t raw_offset;        // decoded offset of the first byte of the frame
+    uint64_t raw_length;        // decoded bytes of the frame
+} index_entry_t;
+
+// end of a framed file
+typedef struct __file_footer_t {
+    uint64_t index_offset;      // position of the first index entry in the container
+    uint64_t n_frames;          // number of index entries
+    char magic[8];              // INDEX_MAGIC
+} file_footer_t;
+
+#endif